@@ -46,7 +46,7 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-	enum {ALLOC, FREE, REALLOC} type; /* type of request */
+	enum {ALLOC, FREE, REALLOC, FREE_SIZED} type; /* type of request */
 	int index;                        /* index for free() to use later */
 	int size;                         /* byte size of alloc/realloc request */
 } traceop_t;
@@ -81,6 +81,9 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	double footprint;/* time-integrated utilization (always 0 for libc) */
+	size_t realloc_inplace; /* reallocs that kept the block in place */
+	size_t realloc_copied;  /* reallocs that moved the block */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -122,11 +125,13 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
 	of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *footprint);
 static void eval_mm_speed(void *ptr);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printreallocs(int n, stats_t *stats);
 static void sumresults(const stats_t *stats, const int n_stats, 
 								int *num_err, double *avg_util, double *avg_tput);
 static void usage(void);
@@ -152,6 +157,7 @@ int main(int argc, char **argv)
 	int team_check = 1;  /* If set, check team structure (reset by -a) */
 	int run_libc = 0;    /* If set, print the results from running libc malloc*/
 	int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+	size_t max_heap = 0; /* heap limit (set by -m) */
 
 	/* temporaries used to compute the performance index */
 	double avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -161,7 +167,7 @@ int main(int argc, char **argv)
 	/* 
 	 * Read and interpret the command line arguments 
 	 */
-	while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+	while ((c = getopt(argc, argv, "f:t:m:hvVgal")) != EOF) {
 		switch (c) {
 			case 'g': /* Generate summary info for the autograder */
 				autograder = 1;
@@ -187,6 +193,12 @@ int main(int argc, char **argv)
 			case 'l': /* Run libc malloc */
 				run_libc = 1;
 				break;
+			case 'm': /* Heap limit, e.g. 512M or 4G */
+				if ((max_heap = mem_parse_size(optarg)) == 0) {
+					usage();
+					exit(1);
+				}
+				break;
 			case 'v': /* Print per-trace performance breakdown */
 				verbose = 1;
 				break;
@@ -258,6 +270,8 @@ int main(int argc, char **argv)
 		unix_error("mm_stats calloc in main failed");
 
 	/* Initialize the simulated memory system in memlib.c */
+	if (max_heap != 0)
+		mem_set_max_heap(max_heap);
 	mem_init(); 
 
 	/* Evaluate student's mm malloc package using the K-best scheme */
@@ -267,10 +281,13 @@ int main(int argc, char **argv)
 		if (verbose > 1)
 			printf("Checking mm_malloc for correctness, ");
 		mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+		mm_realloc_stats(&mm_stats[i].realloc_inplace, 
+				&mm_stats[i].realloc_copied);
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+			mm_stats[i].util = eval_mm_util(trace, i, &ranges,
+					&mm_stats[i].footprint);
 			speed_params.trace = trace;
 			speed_params.ranges = ranges;
 			if (verbose > 1)
@@ -284,6 +301,8 @@ int main(int argc, char **argv)
 	if (verbose) {
 		printf("\nResults for mm malloc:\n");
 		printresults(num_tracefiles, mm_stats);
+		printf("\nRealloc results for mm malloc:\n");
+		printreallocs(num_tracefiles, mm_stats);
 		printf("\n");
 	}
 
@@ -354,9 +373,9 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* The payload must lie within the extent of the heap */
-	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+	/* The payload must lie within the extent of one arena's heap, or
+	   within one region from mem_map */
+	if (!mem_in_heap(lo, hi) && !mem_is_mapped(lo, hi)) {
 		sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 				lo, hi, mem_heap_lo(), mem_heap_hi());
 		malloc_error(tracenum, opnum, msg);
@@ -496,8 +515,9 @@ static trace_t *read_trace(char *tracedir, char *filename)
 				max_index = (index > max_index) ? index : max_index;
 				break;
 			case 'f':
+			case 's':
 				assert(fscanf(tracefile, "%ud", &index)==1);
-				trace->ops[op_index].type = FREE;
+				trace->ops[op_index].type = (type[0] == 'f') ? FREE : FREE_SIZED;
 				trace->ops[op_index].index = index;
 				break;
 			default:
@@ -577,6 +597,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 				 */ 
 				if (add_range(ranges, p, size, tracenum, i) == 0)
 					return 0;
+				if (mm_usable_size(p) < (size_t)size) {
+					malloc_error(tracenum, i, "mm_usable_size is less than the request.");
+					return 0;
+				}
 
 				/* ADDED: cgw
 				 * fill range with low byte of index.  This will be used later
@@ -605,6 +629,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 				/* Check new block for correctness and add it to range list */
 				if (add_range(ranges, newp, size, tracenum, i) == 0)
 					return 0;
+				if (mm_usable_size(newp) < (size_t)size) {
+					malloc_error(tracenum, i, "mm_usable_size is less than the request.");
+					return 0;
+				}
 
 				/* ADDED: cgw
 				 * Make sure that the new block contains the data from the old 
@@ -614,7 +642,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 				oldsize = trace->block_sizes[index];
 				if (size < oldsize) oldsize = size;
 				for (j = 0; j < oldsize; j++) {
-					if (newp[j] != (index & 0xFF)) {
+					if ((unsigned char)newp[j] != (index & 0xFF)) {
 						malloc_error(tracenum, i, "mm_realloc did not preserve the "
 								"data from old block");
 						return 0;
@@ -635,6 +663,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 				mm_free(p);
 				break;
 
+			case FREE_SIZED: /* mm_free_sized */
+
+				/* The same, passing the size of the last malloc or realloc,
+				 * so blocks that realloc shrank in place are freed by size too */
+				p = trace->blocks[index];
+				remove_range(ranges, p);
+				mm_free_sized(p, trace->block_sizes[index]);
+				break;
+
 			default:
 				app_error("Nonexistent request type in eval_mm_valid");
 		}
@@ -650,19 +687,26 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   largest footprint in bytes (heap plus mem_map regions) while
+ *   running the student's malloc package on the trace. The heap can
+ *   shrink (see mem_trim()) and regions come and go, so this is
+ *   mem_peak_footprint() rather than the final brk.
+ *
+ *   Peak utilization says nothing about how quickly the heap gives
+ *   memory back after a spike, so *footprint is set to the
+ *   time-integrated utilization: the live payload bytes summed after
+ *   every request, divided by the footprint summed the same way.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *footprint)
 {   
 	int i;
 	int index;
 	int size, newsize, oldsize;
 	int max_total_size = 0;
 	int total_size = 0;
+	double live_sum = 0;  /* total_size summed after each request */
+	double heap_sum = 0;  /* heap size summed after each request */
 	char *p;
 	char *newp, *oldp;
 
@@ -717,11 +761,15 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 				break;
 
 			case FREE: /* mm_free */
+			case FREE_SIZED: /* mm_free_sized */
 				index = trace->ops[i].index;
 				size = trace->block_sizes[index];
 				p = trace->blocks[index];
 
-				mm_free(p);
+				if (trace->ops[i].type == FREE)
+					mm_free(p);
+				else
+					mm_free_sized(p, size);
 
 				/* Keep track of current total size
 				 * of all allocated blocks */
@@ -733,9 +781,13 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 				app_error("Nonexistent request type in eval_mm_util");
 
 		}
+
+		live_sum += total_size;
+		heap_sum += mem_footprint();
 	}
 
-	return ((double)max_total_size / (double)mem_heapsize());
+	*footprint = (heap_sum > 0) ? live_sum / heap_sum : 0;
+	return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -764,6 +816,7 @@ static void eval_mm_speed(void *ptr)
 				if ((p = mm_malloc(size)) == NULL)
 					app_error("mm_malloc error in eval_mm_speed");
 				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
 				break;
 
 			case REALLOC: /* mm_realloc */
@@ -773,6 +826,7 @@ static void eval_mm_speed(void *ptr)
 				if ((newp = mm_realloc(oldp,newsize)) == NULL)
 					app_error("mm_realloc error in eval_mm_speed");
 				trace->blocks[index] = newp;
+				trace->block_sizes[index] = newsize;
 				break;
 
 			case FREE: /* mm_free */
@@ -781,6 +835,12 @@ static void eval_mm_speed(void *ptr)
 				mm_free(block);
 				break;
 
+			case FREE_SIZED: /* mm_free_sized */
+				index = trace->ops[i].index;
+				block = trace->blocks[index];
+				mm_free_sized(block, trace->block_sizes[index]);
+				break;
+
 			default:
 				app_error("Nonexistent request type in eval_mm_valid");
 		}
@@ -819,6 +879,7 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 				break;
 
 			case FREE: /* free */
+			case FREE_SIZED: /* free */
 				free(trace->blocks[trace->ops[i].index]);
 				break;
 
@@ -863,6 +924,7 @@ static void eval_libc_speed(void *ptr)
 				break;
 
 			case FREE: /* free */
+			case FREE_SIZED: /* free */
 				index = trace->ops[i].index;
 				block = trace->blocks[index];
 				free(block);
@@ -885,30 +947,34 @@ static void printresults(int n, stats_t *stats)
 	double secs = 0;
 	double ops = 0;
 	double util = 0;
+	double footprint = 0;
 	int got_error = 0;
 
 	/* Print the individual results for each trace */
-	printf("%5s%7s %5s%8s%10s%6s\n", 
-			"trace", " valid", "util", "ops", "secs", "Kops");
+	printf("%5s%7s %5s%6s%8s%10s%6s\n", 
+			"trace", " valid", "util", "foot", "ops", "secs", "Kops");
 	for (i=0; i < n; i++) {
 		if (stats[i].valid) {
-			printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+			printf("%2d%10s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f\n", 
 					i,
 					"yes",
 					stats[i].util*100.0,
+					stats[i].footprint*100.0,
 					stats[i].ops,
 					stats[i].secs,
 					(stats[i].ops/1e3)/stats[i].secs);
 			secs += stats[i].secs;
 			ops += stats[i].ops;
 			util += stats[i].util;
+			footprint += stats[i].footprint;
 		} else {
-			printf("%2d%10s%6s%8s%10s%6s\n", 
+			printf("%2d%10s%6s%6s%8s%10s%6s\n", 
 					i,
 					"no",
 					"-",
 					"-",
 					"-",
+					"-",
 					"-");
 			got_error = 1;
 		}
@@ -916,23 +982,49 @@ static void printresults(int n, stats_t *stats)
 
 	/* Print the aggregate results for the set of traces */
 	if (!got_error) {
-		printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+		printf("%12s%5.0f%%%5.0f%%%8.0f%10.6f%6.0f\n", 
 				"Total       ",
 				(util/n)*100.0,
+				(footprint/n)*100.0,
 				ops, 
 				secs,
 				(ops/1e3)/secs);
 	} else {
-		printf("%12s%6s%8s%10s%6s\n", 
+		printf("%12s%6s%6s%8s%10s%6s\n", 
 				"Total       ",
 				"-", 
 				"-", 
 				"-", 
+				"-", 
 				"-");
 	}
 
 }
 
+/*
+ * printreallocs - prints how many of the reallocs in each trace were
+ *     done in place and how many had to copy the block
+ */
+static void printreallocs(int n, stats_t *stats) 
+{
+	int i;
+
+	printf("%5s%10s%10s\n", "trace", "in-place", "copied");
+	for (i=0; i < n; i++) {
+		if (stats[i].valid) {
+			printf("%2d%13lu%10lu\n", 
+					i,
+					(unsigned long)stats[i].realloc_inplace,
+					(unsigned long)stats[i].realloc_copied);
+		} else {
+			printf("%2d%13s%10s\n", 
+					i,
+					"-",
+					"-");
+		}
+	}
+}
+
 /* 
  * Accumulate the aggregate statistics for the student's mm package 
  */
@@ -998,13 +1090,14 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-	fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+	fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-m <size>]\n");
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-a         Don't check the team structure.\n");
 	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
 	fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
 	fprintf(stderr, "\t-h         Print this message.\n");
 	fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+	fprintf(stderr, "\t-m <size>  Limit the heap to <size> bytes (K, M, G suffixes).\n");
 	fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
 	fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
 	fprintf(stderr, "\t-V         Print additional debug info.\n");
@@ -15,6 +15,8 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -46,9 +48,13 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE} type; /* type of request */
+    enum {ALLOC, FREE, MEMALIGN, CALLOC, BATCH_ALLOC, BATCH_FREE,
+	  REGION_CREATE, REGION_ALLOC, REGION_DESTROY} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc request */
+    int align;                        /* alignment of memalign request */
+    int count;                        /* ids index.. of a batch or region request */
+    int region;                       /* first id of a region alloc's region */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -56,10 +62,12 @@ typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
     int num_ids;         /* number of alloc ids */
     int num_ops;         /* number of distinct requests */
+    int num_requests;    /* number of blocks they allocate or free */
     int weight;          /* weight for this trace (unused) */
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    mm_region_t **regions; /* regions, by the first id of each */
 } trace_t;
 
 /* 
@@ -72,6 +80,13 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* Holds the params for one thread of eval_mm_threads */
+typedef struct {
+    trace_t *trace;  /* trace to replay */
+    char **blocks;   /* this thread's ptrs returned by malloc */
+    mm_region_t **regions; /* this thread's regions */
+} replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +96,12 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double footprint;/* time-integrated utilization (always 0 for libc) */
+    double deferred_secs; /* secs with deferred coalescing (only with -c) */
+    size_t precarve_requests; /* mallocs that asked the heap for a block */
+    size_t precarve_hits;     /* ... and got a pre-carved one */
+    int heap_stats_kept;      /* did mm_stats fill in heap_stats? */
+    mm_stats_t heap_stats;    /* mm_stats after the correctness run */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -95,6 +116,18 @@ char msg[MAXLINE];      /* for whenever we need to compose an error message */
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* Number of threads replaying each trace at once in the speed runs */
+static int num_threads = 1;
+
+/* If set, also time each trace with deferred coalescing (set by -c) */
+static int compare_coalescing = 0;
+
+/* If set, call mm_check after every request of the correctness run (-C) */
+static int check_heap = 0;
+
+/* If set, replay batch requests one block at a time (set by -u) */
+static int unbatch = 0;
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -115,6 +148,12 @@ static void clear_ranges(range_t **ranges);
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
 
+/* These functions make an allocation request of either package */
+static char *mm_request(traceop_t *op);
+static char *libc_request(traceop_t *op);
+static int mm_region_request(traceop_t *op, mm_region_t **regions, char **blocks);
+static int libc_region_request(traceop_t *op, char **blocks);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
@@ -122,11 +161,18 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *footprint);
 static void eval_mm_speed(void *ptr);
+static double eval_mm_threads(trace_t *trace, int num_threads);
+static void *replay_trace(void *ptr);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printcoalescing(int n, stats_t *stats);
+static void printprecarving(int n, stats_t *stats);
+static void record_heap_stats(stats_t *stats);
+static void printheapstats(int n, stats_t *stats);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -141,6 +187,7 @@ int main(int argc, char **argv)
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
+    int threads;               /* threads timing the current trace */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
@@ -148,6 +195,7 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
+    size_t max_heap = 0;         /* heap limit (set by -m) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
 
     /* temporaries used to compute the performance index */
@@ -157,7 +205,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgl")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:p:m:cChuvVgl")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -180,6 +228,32 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+	case 'p': /* Replay each trace in several threads at once */
+	    num_threads = atoi(optarg);
+	    if (num_threads < 1) {
+		usage();
+		exit(1);
+	    }
+#if !MM_THREAD_SAFE
+	    if (num_threads > 1)
+		app_error("-p needs mm.c built with MMFLAGS=-DMM_THREAD_SAFE=1");
+#endif
+	    break;
+	case 'm': /* Heap limit, e.g. 512M or 4G */
+	    if ((max_heap = mem_parse_size(optarg)) == 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+	case 'C': /* Check the heap after every request */
+	    check_heap = 1;
+	    break;
+	case 'u': /* Replay batch requests one block at a time */
+	    unbatch = 1;
+	    break;
+	case 'c': /* Compare eager and deferred coalescing */
+	    compare_coalescing = 1;
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -223,7 +297,7 @@ int main(int argc, char **argv)
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
 	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
+	    libc_stats[i].ops = trace->num_requests;
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
 	    libc_stats[i].valid = eval_libc_valid(trace, i);
@@ -255,32 +329,75 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
+    if (max_heap != 0)
+	mem_set_max_heap(max_heap);
     mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
 	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+	mm_stats[i].ops = trace->num_requests;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
 	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	mm_precarve_stats(&mm_stats[i].precarve_hits,
+			  &mm_stats[i].precarve_requests);
+	record_heap_stats(&mm_stats[i]);
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges,
+					     &mm_stats[i].footprint);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    /* Each thread needs as much heap as the util run did */
+	    threads = num_threads;
+	    if (threads > 1 &&
+		(double)threads * mem_peak_footprint() > mem_max_heap_size()) {
+		printf("Trace %d does not fit in the heap limit %d times; "
+		       "timing it in one thread\n", i, threads);
+		threads = 1;
+	    }
+	    if (threads > 1) {
+		mm_stats[i].ops = (double)threads * trace->num_requests;
+		mm_stats[i].secs = eval_mm_threads(trace, threads);
+	    }
+	    else
+		mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+
+	    /* Optionally check and time the trace again with deferred
+	       coalescing, the same way */
+	    if (compare_coalescing) {
+		mm_defer_coalescing(1);
+		if (eval_mm_valid(trace, i, &ranges)) {
+		    if (threads > 1)
+			mm_stats[i].deferred_secs = eval_mm_threads(trace, threads);
+		    else
+			mm_stats[i].deferred_secs = fsecs(eval_mm_speed, 
+							  &speed_params);
+		}
+		mm_defer_coalescing(0);
+	    }
 	}
 	free_trace(trace);
     }
 
     /* Display the mm results in a compact table */
     if (verbose) {
-	printf("\nResults for mm malloc:\n");
+	if (num_threads > 1)
+	    printf("\nResults for mm malloc (%d threads):\n", num_threads);
+	else
+	    printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
+	printprecarving(num_tracefiles, mm_stats);
+	printheapstats(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+    if (compare_coalescing) {
+	printf("Throughput (Kops) with eager and deferred coalescing:\n");
+	printcoalescing(num_tracefiles, mm_stats);
 	printf("\n");
     }
 
@@ -365,9 +482,9 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of one arena's heap, or
+       within one region from mem_map */
+    if (!mem_in_heap(lo, hi) && !mem_is_mapped(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -447,7 +564,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align, count, region;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -484,31 +601,88 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace->block_sizes = 
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
+
+    /* ... and the regions the trace creates */
+    if ((trace->regions = 
+	 (mm_region_t **)malloc(trace->num_ids * sizeof(mm_region_t *))) == NULL)
+	unix_error("malloc 5 failed in read_trace");
     
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
+    trace->num_requests = 0;
     while (fscanf(tracefile, "%s", type) != EOF) {
 	switch(type[0]) {
 	case 'a':
+	case 'c':
 	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
+	    trace->ops[op_index].type = (type[0] == 'a') ? ALLOC : CALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &size, &align);
+	    if (align == 0 || (align & (align - 1)) != 0) {
+		printf("Alignment %u is not a power of two in tracefile %s\n",
+		       align, path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
+	case 'b':
+	case 'B':
+	    if (type[0] == 'b')
+		fscanf(tracefile, "%u %u %u", &index, &count, &size);
+	    else
+		fscanf(tracefile, "%u %u", &index, &count);
+	    if (count == 0) {
+		printf("Empty batch request in tracefile %s\n", path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = (type[0] == 'b') ? BATCH_ALLOC : BATCH_FREE;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].count = count;
+	    trace->num_requests += count - 1;
+	    max_index = (index + count - 1 > max_index) ? index + count - 1 : max_index;
+	    break;
+	case 'n':
+	case 'd':
+	    fscanf(tracefile, "%u %u", &index, &count);
+	    if (count == 0) {
+		printf("Empty region in tracefile %s\n", path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = (type[0] == 'n') ? REGION_CREATE : REGION_DESTROY;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].count = count;
+	    max_index = (index + count - 1 > max_index) ? index + count - 1 : max_index;
+	    break;
+	case 'o':
+	    fscanf(tracefile, "%u %u %u", &region, &index, &size);
+	    trace->ops[op_index].type = REGION_ALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].region = region;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
 	    exit(1);
 	}
 	op_index++;
-	
+	trace->num_requests++;
     }
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
@@ -518,17 +692,132 @@ static trace_t *read_trace(char *tracedir, char *filename)
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
+ * free_trace - Free the trace record and the four arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    free(trace->ops);         /* free the four arrays... */
     free(trace->blocks);      
     free(trace->block_sizes);
+    free(trace->regions);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * mm_request - Make the allocation request op (ALLOC, MEMALIGN or
+ *     CALLOC) of the mm package
+ */
+static char *mm_request(traceop_t *op)
+{
+    if (op->type == MEMALIGN)
+	return mm_memalign(op->align, op->size);
+    if (op->type == CALLOC)
+	return mm_calloc(1, op->size);
+    return mm_malloc(op->size);
+}
+
+/*
+ * libc_request - Make the allocation request op (ALLOC, MEMALIGN or
+ *     CALLOC) of libc malloc
+ */
+static char *libc_request(traceop_t *op)
+{
+    void *p;
+
+    if (op->type == MEMALIGN)
+	return (posix_memalign(&p, op->align < sizeof(void *) ?
+			       sizeof(void *) : op->align, op->size) == 0) ? 
+	    p : NULL;
+    if (op->type == CALLOC)
+	return calloc(1, op->size);
+    return malloc(op->size);
+}
+
+/*
+ * mm_batch_request - Make the batch request op (BATCH_ALLOC or
+ *     BATCH_FREE) of the mm package for ids op->index and up, whose
+ *     blocks are in blocks[]. Returns 0 if an allocation failed.
+ */
+static int mm_batch_request(traceop_t *op, char **blocks)
+{
+    char **batch = &blocks[op->index];
+    int i;
+
+    if (op->type == BATCH_FREE) {
+	if (unbatch)
+	    for (i = 0; i < op->count; i++)
+		mm_free(batch[i]);
+	else
+	    mm_free_batch((void **)batch, op->count);
+	return 1;
+    }
+    if (unbatch) {
+	for (i = 0; i < op->count; i++)
+	    if ((batch[i] = mm_malloc(op->size)) == NULL)
+		return 0;
+	return 1;
+    }
+    return mm_malloc_batch(op->size, op->count, (void **)batch) == (size_t)op->count;
+}
+
+/*
+ * libc_batch_request - Make the batch request op of libc malloc, one
+ *     block at a time
+ */
+static int libc_batch_request(traceop_t *op, char **blocks)
+{
+    int i;
+
+    for (i = op->index; i < op->index + op->count; i++) {
+	if (op->type == BATCH_FREE)
+	    free(blocks[i]);
+	else if ((blocks[i] = malloc(op->size)) == NULL)
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * mm_region_request - Make the region request op (REGION_CREATE,
+ *     REGION_ALLOC or REGION_DESTROY) of the mm package. A region is
+ *     kept in regions[] under the first of its ids, and its objects
+ *     in blocks[]. Returns 0 if creating or allocating failed.
+ */
+static int mm_region_request(traceop_t *op, mm_region_t **regions, char **blocks)
+{
+    switch (op->type) {
+    case REGION_CREATE:
+	return (regions[op->index] = mm_region_create()) != NULL;
+    case REGION_ALLOC:
+	return (blocks[op->index] = mm_region_alloc(regions[op->region], op->size)) != NULL;
+    default:
+	mm_region_destroy(regions[op->index]);
+	return 1;
+    }
+}
+
+/*
+ * libc_region_request - Make the region request op of libc malloc,
+ *     which has no regions: each object is malloced, and destroying
+ *     the region frees them one at a time
+ */
+static int libc_region_request(traceop_t *op, char **blocks)
+{
+    int i;
+
+    switch (op->type) {
+    case REGION_CREATE:
+	return 1;
+    case REGION_ALLOC:
+	return (blocks[op->index] = malloc(op->size)) != NULL;
+    default:
+	for (i = op->index; i < op->index + op->count; i++)
+	    free(blocks[i]);
+	return 1;
+    }
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -539,7 +828,7 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i;
+    int i, j, k;
     int index;
     int size;
     char *p;
@@ -562,12 +851,27 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
 
-	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    /* Call the student's malloc or memalign */
+	    if ((p = mm_request(&trace->ops[i])) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
+	    if (trace->ops[i].type == MEMALIGN &&
+		(size_t)p % trace->ops[i].align != 0) {
+		malloc_error(tracenum, i, "mm_memalign returned a misaligned block.");
+		return 0;
+	    }
+	    if (trace->ops[i].type == CALLOC) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			malloc_error(tracenum, i, "mm_calloc returned a block that is not zeroed.");
+			return 0;
+		    }
+		}
+	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
@@ -576,6 +880,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+	    if (mm_usable_size(p) < (size_t)size) {
+		malloc_error(tracenum, i, "mm_usable_size is less than the request.");
+		return 0;
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -597,10 +905,69 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    mm_free(p);
 	    break;
 
+	case BATCH_ALLOC: /* mm_malloc_batch */
+	    if (!mm_batch_request(&trace->ops[i], trace->blocks)) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+	    for (j = index; j < index + trace->ops[i].count; j++) {
+		p = trace->blocks[j];
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, j & 0xFF, size);
+		trace->block_sizes[j] = size;
+	    }
+	    break;
+
+	case BATCH_FREE: /* mm_free_batch */
+	    for (j = index; j < index + trace->ops[i].count; j++)
+		remove_range(ranges, trace->blocks[j]);
+	    mm_batch_request(&trace->ops[i], trace->blocks);
+	    break;
+
+	case REGION_CREATE: /* mm_region_create */
+	    if (!mm_region_request(&trace->ops[i], trace->regions, trace->blocks)) {
+		malloc_error(tracenum, i, "mm_region_create failed.");
+		return 0;
+	    }
+	    break;
+
+	case REGION_ALLOC: /* mm_region_alloc */
+	    if (!mm_region_request(&trace->ops[i], trace->regions, trace->blocks)) {
+		malloc_error(tracenum, i, "mm_region_alloc failed.");
+		return 0;
+	    }
+	    p = trace->blocks[index];
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+	    trace->block_sizes[index] = size;
+	    break;
+
+	case REGION_DESTROY: /* mm_region_destroy */
+	    /* Each object must still hold what was written to it */
+	    for (j = index; j < index + trace->ops[i].count; j++) {
+		p = trace->blocks[j];
+		for (k = 0; k < (int)trace->block_sizes[j]; k++) {
+		    if ((unsigned char)p[k] != (j & 0xFF)) {
+			malloc_error(tracenum, i, "mm_region_alloc object was overwritten.");
+			return 0;
+		    }
+		}
+		remove_range(ranges, p);
+	    }
+	    mm_region_request(&trace->ops[i], trace->regions, trace->blocks);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 
+	/* Optionally have the allocator check its own heap */
+	if (check_heap && !mm_check()) {
+	    malloc_error(tracenum, i, "mm_check found the heap inconsistent.");
+	    return 0;
+	}
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -612,19 +979,26 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
- *   
+ *   largest footprint in bytes (heap plus mem_map regions) while
+ *   running the student's malloc package on the trace. The heap can
+ *   shrink (see mem_trim()) and regions come and go, so this is
+ *   mem_peak_footprint() rather than the final brk.
+ *
+ *   Peak utilization says nothing about how quickly the heap gives
+ *   memory back after a spike, so *footprint is set to the
+ *   time-integrated utilization: the live payload bytes summed after
+ *   every request, divided by the footprint summed the same way.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *footprint)
 {   
-    int i;
+    int i, j;
     int index;
     int size;
     int max_total_size = 0;
     int total_size = 0;
+    double live_sum = 0;  /* total_size summed after each request */
+    double heap_sum = 0;  /* heap size summed after each request */
     char *p;
 
     /* initialize the heap and the mm malloc package */
@@ -636,10 +1010,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = mm_request(&trace->ops[i])) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -668,13 +1044,57 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case BATCH_ALLOC: /* mm_malloc_batch */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+
+	    if (!mm_batch_request(&trace->ops[i], trace->blocks))
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (j = index; j < index + trace->ops[i].count; j++)
+		trace->block_sizes[j] = size;
+	    total_size += trace->ops[i].count * size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case BATCH_FREE: /* mm_free_batch */
+	    index = trace->ops[i].index;
+	    for (j = index; j < index + trace->ops[i].count; j++)
+		total_size -= trace->block_sizes[j];
+	    mm_batch_request(&trace->ops[i], trace->blocks);
+	    break;
+
+        case REGION_CREATE: /* mm_region_create */
+        case REGION_ALLOC: /* mm_region_alloc */
+	    if (!mm_region_request(&trace->ops[i], trace->regions, trace->blocks))
+		app_error("mm_region request failed in eval_mm_util");
+	    if (trace->ops[i].type == REGION_ALLOC) {
+		size = trace->ops[i].size;
+		trace->block_sizes[trace->ops[i].index] = size;
+		total_size += size;
+		max_total_size = (total_size > max_total_size) ?
+		    total_size : max_total_size;
+	    }
+	    break;
+
+        case REGION_DESTROY: /* mm_region_destroy */
+	    index = trace->ops[i].index;
+	    for (j = index; j < index + trace->ops[i].count; j++)
+		total_size -= trace->block_sizes[j];
+	    mm_region_request(&trace->ops[i], trace->regions, trace->blocks);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	live_sum += total_size;
+	heap_sum += mem_footprint();
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    *footprint = (heap_sum > 0) ? live_sum / heap_sum : 0;
+    return ((double)max_total_size / (double)mem_peak_footprint());
 }
 
 
@@ -684,7 +1104,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size;
+    int i, index;
     char *p, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -698,9 +1118,10 @@ static void eval_mm_speed(void *ptr)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
             index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm_request(&trace->ops[i])) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -711,11 +1132,125 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case BATCH_ALLOC: /* mm_malloc_batch */
+        case BATCH_FREE: /* mm_free_batch */
+            if (!mm_batch_request(&trace->ops[i], trace->blocks))
+		app_error("mm_malloc_batch error in eval_mm_speed");
+            break;
+
+        case REGION_CREATE: /* mm_region_create */
+        case REGION_ALLOC: /* mm_region_alloc */
+        case REGION_DESTROY: /* mm_region_destroy */
+            if (!mm_region_request(&trace->ops[i], trace->regions, trace->blocks))
+		app_error("mm_region error in eval_mm_speed");
+            break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
 }
 
+/*
+ * eval_mm_threads - Replay the trace in num_threads threads at once on
+ *    a single heap, each thread with blocks of its own, and return the
+ *    best wall-clock time of THREAD_RUNS such runs. (fsecs measures
+ *    process CPU time, which adds up over the threads, so it cannot
+ *    show how throughput scales with the number of threads.)
+ */
+#define THREAD_RUNS 3
+
+static double eval_mm_threads(trace_t *trace, int num_threads)
+{
+    int run, t;
+    double secs, best_secs = DBL_MAX;
+    struct timeval start, end;
+    pthread_t *threads;
+    replay_t *replays;
+
+    if ((threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t))) == NULL ||
+	(replays = (replay_t *)calloc(num_threads, sizeof(replay_t))) == NULL)
+	unix_error("calloc in eval_mm_threads failed");
+    for (t = 0; t < num_threads; t++) {
+	replays[t].trace = trace;
+	if ((replays[t].blocks = (char **)calloc(trace->num_ids, sizeof(char *))) == NULL ||
+	    (replays[t].regions = (mm_region_t **)calloc(trace->num_ids,
+							 sizeof(mm_region_t *))) == NULL)
+	    unix_error("calloc in eval_mm_threads failed");
+    }
+
+    for (run = 0; run < THREAD_RUNS; run++) {
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in eval_mm_threads");
+
+	gettimeofday(&start, NULL);
+	for (t = 0; t < num_threads; t++)
+	    if (pthread_create(&threads[t], NULL, replay_trace, &replays[t]) != 0)
+		unix_error("pthread_create in eval_mm_threads failed");
+	for (t = 0; t < num_threads; t++)
+	    pthread_join(threads[t], NULL);
+	gettimeofday(&end, NULL);
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	if (secs < best_secs)
+	    best_secs = secs;
+    }
+
+    for (t = 0; t < num_threads; t++) {
+	free(replays[t].blocks);
+	free(replays[t].regions);
+    }
+    free(replays);
+    free(threads);
+    return best_secs;
+}
+
+/*
+ * replay_trace - The body of one eval_mm_threads thread: interpret
+ *    each trace request against the shared mm heap.
+ */
+static void *replay_trace(void *ptr)
+{
+    int i, index;
+    replay_t *replay = (replay_t *)ptr;
+    trace_t *trace = replay->trace;
+
+    for (i = 0;  i < trace->num_ops;  i++)
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+        case CALLOC: /* mm_calloc */
+            index = trace->ops[i].index;
+            if ((replay->blocks[index] = mm_request(&trace->ops[i])) == NULL)
+		app_error("mm_malloc error in replay_trace");
+            break;
+
+        case FREE: /* mm_free */
+            index = trace->ops[i].index;
+            mm_free(replay->blocks[index]);
+            break;
+
+        case BATCH_ALLOC: /* mm_malloc_batch */
+        case BATCH_FREE: /* mm_free_batch */
+            if (!mm_batch_request(&trace->ops[i], replay->blocks))
+		app_error("mm_malloc_batch error in replay_trace");
+            break;
+
+        case REGION_CREATE: /* mm_region_create */
+        case REGION_ALLOC: /* mm_region_alloc */
+        case REGION_DESTROY: /* mm_region_destroy */
+            if (!mm_region_request(&trace->ops[i], replay->regions, replay->blocks))
+		app_error("mm_region error in replay_trace");
+            break;
+
+	default:
+	    app_error("Nonexistent request type in replay_trace");
+        }
+    return NULL;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -731,7 +1266,9 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+        case MEMALIGN: /* posix_memalign */
+        case CALLOC: /* calloc */
+	    if ((p = libc_request(&trace->ops[i])) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
@@ -741,6 +1278,24 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
         case FREE: /* free */
            free(trace->blocks[trace->ops[i].index]);
            break;	
+
+        case BATCH_ALLOC: /* malloc, one block at a time */
+        case BATCH_FREE: /* free, one block at a time */
+	    if (!libc_batch_request(&trace->ops[i], trace->blocks)) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    break;
+
+        case REGION_CREATE: /* nothing */
+        case REGION_ALLOC: /* malloc */
+        case REGION_DESTROY: /* free, one object at a time */
+	    if (!libc_region_request(&trace->ops[i], trace->blocks)) {
+		malloc_error(tracenum, i, "libc malloc failed");
+		unix_error("System message");
+	    }
+	    break;
+
 		default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
@@ -757,16 +1312,17 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 static void eval_libc_speed(void *ptr)
 {
     int i;
-    int index, size;
+    int index;
     char *p, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case MEMALIGN: /* posix_memalign */
+        case CALLOC: /* calloc */
 	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
+	    if ((p = libc_request(&trace->ops[i])) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
@@ -776,6 +1332,19 @@ static void eval_libc_speed(void *ptr)
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+        case BATCH_ALLOC: /* malloc, one block at a time */
+        case BATCH_FREE: /* free, one block at a time */
+	    if (!libc_batch_request(&trace->ops[i], trace->blocks))
+		unix_error("malloc failed in eval_libc_speed");
+	    break;
+
+        case REGION_CREATE: /* nothing */
+        case REGION_ALLOC: /* malloc */
+        case REGION_DESTROY: /* free, one object at a time */
+	    if (!libc_region_request(&trace->ops[i], trace->blocks))
+		unix_error("malloc failed in eval_libc_speed");
+	    break;
 	}
     }
 }
@@ -794,54 +1363,175 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double footprint = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%8s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%6s%8s%10s%8s\n", 
+	   "trace", " valid", "util", "foot", "ops", "secs", "Kops");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%8.0f\n", 
+	    printf("%2d%10s%5.0f%%%5.0f%%%8.0f%10.6f%8.0f\n", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
+		   stats[i].footprint*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    footprint += stats[i].footprint;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%8s\n", 
+	    printf("%2d%10s%6s%6s%8s%10s%8s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%8.0f\n", 
+	printf("%12s%5.0f%%%5.0f%%%8.0f%10.6f%8.0f\n", 
 	       "Total       ",
 	       (util/n)*100.0,
+	       (footprint/n)*100.0,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
     }
     else {
-	printf("%12s%6s%8s%10s%8s\n", 
+	printf("%12s%6s%6s%8s%10s%8s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
+	       "-", 
 	       "-");
     }
 
 }
 
+/*
+ * printprecarving - Print how many of the heap blocks requested in each
+ *     trace's correctness run came from a pre-carved pool (nothing if
+ *     mm.c was built without PRECARVE)
+ */
+static void printprecarving(int n, stats_t *stats)
+{
+    int i;
+
+    for (i=0; i < n && stats[i].precarve_requests == 0; i++)
+	;
+    if (i == n)
+	return;
+
+    printf("\nPre-carved pool results for mm malloc:\n");
+    printf("%5s%10s%10s%9s\n", "trace", "requests", "hits", "hit rate");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid && stats[i].precarve_requests > 0) {
+	    printf("%2d%13lu%10lu%8.0f%%\n",
+		   i,
+		   (unsigned long)stats[i].precarve_requests,
+		   (unsigned long)stats[i].precarve_hits,
+		   100.0 * stats[i].precarve_hits / stats[i].precarve_requests);
+	}
+	else {
+	    printf("%2d%13s%10s%9s\n", i, "-", "-", "-");
+	}
+    }
+}
+
+/*
+ * record_heap_stats - Save mm_stats at the end of a trace's correctness
+ *     run in its stats
+ */
+static void record_heap_stats(stats_t *stats)
+{
+    stats->heap_stats_kept = mm_stats(&stats->heap_stats);
+}
+
+/*
+ * printheapstats - Print the allocator statistics of each trace's
+ *     correctness run (nothing if mm.c was built without MM_STATS)
+ */
+static void printheapstats(int n, stats_t *stats)
+{
+    int i;
+    mm_stats_t *heap;
+
+    for (i=0; i < n && !stats[i].heap_stats_kept; i++)
+	;
+    if (i == n)
+	return;
+
+    printf("\nAllocator statistics for mm malloc:\n");
+    printf("%5s%10s%10s%10s%10s%10s%10s%8s\n", "trace", "live KB", "free KB",
+	   "splits", "merges", "searches", "steps", "sbrks");
+    for (i=0; i < n; i++) {
+	heap = &stats[i].heap_stats;
+	if (stats[i].valid && stats[i].heap_stats_kept) {
+	    printf("%2d%13lu%10lu%10lu%10lu%10lu%10.1f%8lu\n",
+		   i,
+		   (unsigned long)heap->liveBytes / 1024,
+		   (unsigned long)heap->freeBytes / 1024,
+		   (unsigned long)heap->splits,
+		   (unsigned long)heap->coalesces,
+		   (unsigned long)heap->searches,
+		   heap->searches > 0 ?
+		   (double)heap->searchSteps / heap->searches : 0.0,
+		   (unsigned long)heap->sbrkCalls);
+	}
+	else {
+	    printf("%2d%13s%10s%10s%10s%10s%10s%8s\n",
+		   i, "-", "-", "-", "-", "-", "-", "-");
+	}
+    }
+}
+
+/*
+ * printcoalescing - Print the throughput of each trace with eager and
+ *     with deferred coalescing, as timed by -c
+ */
+static void printcoalescing(int n, stats_t *stats)
+{
+    int i;
+    double ops = 0;
+    double secs = 0;
+    double deferred_secs = 0;
+
+    printf("%5s%10s%10s%9s\n", "trace", "eager", "deferred", "speedup");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid && stats[i].deferred_secs > 0) {
+	    printf("%2d%13.0f%10.0f%8.2fx\n",
+		   i,
+		   (stats[i].ops/1e3)/stats[i].secs,
+		   (stats[i].ops/1e3)/stats[i].deferred_secs,
+		   stats[i].secs/stats[i].deferred_secs);
+	    ops += stats[i].ops;
+	    secs += stats[i].secs;
+	    deferred_secs += stats[i].deferred_secs;
+	}
+	else {
+	    printf("%2d%13s%10s%9s\n", i, "-", "-", "-");
+	}
+    }
+
+    /* Print the aggregate results for the set of traces */
+    if (deferred_secs > 0) {
+	printf("%5s%10.0f%10.0f%8.2fx\n",
+	       "Total",
+	       (ops/1e3)/secs,
+	       (ops/1e3)/deferred_secs,
+	       secs/deferred_secs);
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -874,13 +1564,18 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-cChuvVal] [-f <file>] [-t <dir>] [-p <n>] [-m <size>]\n");
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c         Compare throughput with deferred coalescing.\n");
+    fprintf(stderr, "\t-C         Run mm_check after every request.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-m <size>  Limit the heap to <size> bytes (K, M, G suffixes).\n");
+    fprintf(stderr, "\t-p <n>     Time each trace replayed by <n> threads at once.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-u         Replay batch requests one block at a time.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
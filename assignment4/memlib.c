@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +11,150 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * The simulated memory has up to MEM_MAX_ARENAS heaps, called arenas,
+ * each with a brk of its own in a region of its own, mem_max_heap bytes
+ * long.  That limit is MAX_HEAP unless mem_set_max_heap or the
+ * MEM_MAX_HEAP environment variable (e.g. MEM_MAX_HEAP=4G) says
+ * otherwise; since regions are only reserved, not committed (see
+ * below), it can run to gigabytes at no cost until used.  Arena 0
+ * is set up by mem_init and is "the heap" of mem_sbrk and friends; the
+ * others get their region the first time they are extended.
+ *
+ * Like the system calls it models, memlib is safe to call from
+ * several threads: mem_lock guards the arenas' brks, the mem_map
+ * regions and the footprint counters.
+ *
+ * An arena's region is an anonymous mapping aligned to
+ * MEM_HUGE_PAGE_SIZE and marked for transparent huge pages, so a big
+ * heap sits on a few 2 MB TLB entries rather than thousands of 4 KB
+ * ones.  Where the system will not map it, the region comes from
+ * malloc as before.  Built with -DMEM_HUGE_GROWTH=1, mem_pagesize
+ * reports the huge page size whenever the heap is on huge pages, so
+ * the malloc package grows the heap a whole huge page at a time.
+ *
+ * A mapped region is only reserved at first: its pages are committed
+ * (made accessible) as mem_sbrk moves brk over them and decommitted
+ * (handed back to the system, then made inaccessible again) when
+ * mem_trim or mem_reset_brk moves brk back below them.  That way an
+ * arena occupies about as much memory as its heap size, not its limit.
+ * Pages the system has never handed out, or has taken back with
+ * MADV_DONTNEED, read as zero; mem_arena_zeroed tells the malloc
+ * package whether its last extension of an arena was all such pages,
+ * so calloc need not clear them again.
+ */
+#define MEM_HUGE_PAGE_SIZE (2*(1<<20))
+
+#ifndef MEM_HUGE_GROWTH
+#define MEM_HUGE_GROWTH 0
+#endif
+
+typedef struct {
+  char *start_brk;  /* points to first byte of the arena */
+  char *brk;        /* points to last byte of the arena, plus one */
+  char *max_addr;   /* largest legal arena address */
+  char *commit;     /* end of the committed part of the region */
+  char *dirty;      /* end of the part that may hold nonzero bytes */
+  int mapped;       /* is the region a mapping (else from malloc)? */
+  int zeroed;       /* did the last mem_arena_sbrk add only zero bytes? */
+} mem_arena_t;
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static mem_arena_t mem_arenas[MEM_MAX_ARENAS];
+static int mem_huge;         /* are the regions on transparent huge pages? */
+static size_t mem_max_heap;  /* size of each arena's region (0 until mem_init) */
+static size_t mem_mapped;    /* bytes in mem_map regions */
+static size_t mem_peak;      /* largest heap + mapped size since the last reset */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A region handed out by mem_map, kept on a list so mem_reset_brk can
+   drop every region and the drivers can check payloads against them */
+typedef struct mem_region_t {
+  char *lo;                   /* first byte of the region */
+  size_t size;                /* size of the region in bytes */
+  struct mem_region_t *next;  /* next region on the list */
+} mem_region_t;
+
+static mem_region_t *mem_regions;  /* all live mem_map regions */
+
+static int mem_reserve(mem_arena_t *a);
+static void mem_release(mem_arena_t *a);
+static int mem_commit(mem_arena_t *a, char *new_brk);
+static void mem_decommit(mem_arena_t *a, char *new_brk);
+static void mem_update_peak(void);
+static mem_region_t **mem_find_region(void *addr);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
+  char *env;
+
+  /* the heap limit: mem_set_max_heap, else MEM_MAX_HEAP, else MAX_HEAP */
+  if (mem_max_heap == 0 && (env = getenv("MEM_MAX_HEAP")) != NULL &&
+      (mem_max_heap = mem_parse_size(env)) == 0) {
+    fprintf(stderr, "mem_init_vm: bad MEM_MAX_HEAP \"%s\"\n", env);
+    exit(1);
+  }
+  if (mem_max_heap == 0)
+    mem_max_heap = MAX_HEAP;
+  mem_max_heap = (mem_max_heap + mem_syspagesize() - 1) / mem_syspagesize() * mem_syspagesize();
+
   /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+  if (mem_reserve(&mem_arenas[0]) == -1) {
     fprintf(stderr, "mem_init_vm: malloc error\n");
     exit(1);
   }
+  mem_mapped = 0;
+  mem_peak = 0;
+  mem_regions = NULL;
+}
+
+/*
+ * mem_set_max_heap - set the size each arena may grow to. Call before
+ *    mem_init; takes precedence over MEM_MAX_HEAP.
+ */
+void mem_set_max_heap(size_t size)
+{
+  mem_max_heap = size;
+}
 
-  mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-  mem_brk = mem_start_brk;                  /* heap is empty initially */
+/*
+ * mem_max_heap_size - returns the size each arena may grow to
+ */
+size_t mem_max_heap_size()
+{
+  return mem_max_heap;
+}
+
+/*
+ * mem_parse_size - parse a size in bytes with an optional K, M or G
+ *    suffix, such as "512M". Returns 0 if s is not such a size.
+ */
+size_t mem_parse_size(const char *s)
+{
+  char *end;
+  unsigned long long size;
+  int shift = 0;
+
+  errno = 0;
+  size = strtoull(s, &end, 10);
+  if (errno != 0 || end == s)
+    return 0;
+  switch (*end) {
+  case 'K': case 'k': shift = 10; end++; break;
+  case 'M': case 'm': shift = 20; end++; break;
+  case 'G': case 'g': shift = 30; end++; break;
+  }
+  if (*end != '\0' || size > ((size_t)-1 >> shift))
+    return 0;
+  return (size_t)size << shift;
 }
 
 /* 
@@ -39,33 +162,50 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-  free(mem_start_brk);
+  int arena;
+
+  mem_reset_brk();
+  for (arena = 0; arena < MEM_MAX_ARENAS; arena++)
+    mem_release(&mem_arenas[arena]);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointers to make every arena
+ *    empty, decommitting their regions, and unmap every mem_map region
  */
 void mem_reset_brk()
 {
-  mem_brk = mem_start_brk;
+  int arena;
+
+  while (mem_regions != NULL)
+    mem_unmap(mem_regions->lo, mem_regions->size);
+  pthread_mutex_lock(&mem_lock);
+  for (arena = 0; arena < MEM_MAX_ARENAS; arena++) {
+    mem_decommit(&mem_arenas[arena], mem_arenas[arena].start_brk);
+    mem_arenas[arena].brk = mem_arenas[arena].start_brk;
+  }
+  mem_peak = 0;
+  pthread_mutex_unlock(&mem_lock);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
  *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    this model, the heap cannot be shrunk with mem_sbrk; use mem_trim.
  */
 void *mem_sbrk(size_t incr) 
 {
-  char *old_brk = mem_brk;
+  return mem_arena_sbrk(0, incr);
+}
 
-  if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
-    errno = ENOMEM;
-    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-    return (void *)-1;
-  }
-  mem_brk += incr;
-  return (void *)old_brk;
+/*
+ * mem_trim - shrinks the heap by decr bytes, handing the top of the
+ *    heap back to the system, and returns the new brk. Fails if that
+ *    would move brk below the start of the heap.
+ */
+void *mem_trim(size_t decr)
+{
+  return mem_arena_trim(0, decr);
 }
 
 /*
@@ -73,7 +213,7 @@ void *mem_sbrk(size_t incr)
  */
 void *mem_heap_lo()
 {
-  return (void *)mem_start_brk;
+  return mem_arena_lo(0);
 }
 
 /* 
@@ -81,21 +221,430 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-  return (void *)(mem_brk - 1);
+  return mem_arena_hi(0);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_arena_sbrk - mem_sbrk for the given arena, giving the arena its
+ *    region first if it has none yet
+ */
+void *mem_arena_sbrk(int arena, size_t incr)
+{
+  mem_arena_t *a = &mem_arenas[arena];
+  char *old_brk;
+
+  assert(arena >= 0 && arena < MEM_MAX_ARENAS);
+  pthread_mutex_lock(&mem_lock);
+  if (a->start_brk == NULL && mem_reserve(a) == -1) {
+    pthread_mutex_unlock(&mem_lock);
+    errno = ENOMEM;
+    fprintf(stderr, "ERROR: mem_arena_sbrk failed. No region for arena %d...\n", arena);
+    return (void *)-1;
+  }
+
+  old_brk = a->brk;
+  if ((a->brk + incr) > a->max_addr || mem_commit(a, a->brk + incr) == -1) {
+    pthread_mutex_unlock(&mem_lock);
+    errno = ENOMEM;
+    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+    return (void *)-1;
+  }
+  a->brk += incr;
+  a->zeroed = (old_brk >= a->dirty);
+  if (a->brk > a->dirty)
+    a->dirty = a->brk;
+  mem_update_peak();
+  pthread_mutex_unlock(&mem_lock);
+  return (void *)old_brk;
+}
+
+/*
+ * mem_arena_trim - mem_trim for the given arena
+ */
+void *mem_arena_trim(int arena, size_t decr)
+{
+  mem_arena_t *a = &mem_arenas[arena];
+  void *new_brk;
+
+  assert(arena >= 0 && arena < MEM_MAX_ARENAS);
+  pthread_mutex_lock(&mem_lock);
+  if (decr > (size_t)(a->brk - a->start_brk)) {
+    pthread_mutex_unlock(&mem_lock);
+    errno = EINVAL;
+    fprintf(stderr, "ERROR: mem_trim failed. Heap is smaller than the request...\n");
+    return (void *)-1;
+  }
+  a->brk -= decr;
+  mem_decommit(a, a->brk);
+  new_brk = (void *)a->brk;
+  pthread_mutex_unlock(&mem_lock);
+  return new_brk;
+}
+
+/*
+ * mem_arena_zeroed - returns 1 if every byte the last mem_arena_sbrk
+ *    of the given arena added was zero, and 0 if some may not be
+ */
+int mem_arena_zeroed(int arena)
+{
+  int zeroed;
+
+  assert(arena >= 0 && arena < MEM_MAX_ARENAS);
+  pthread_mutex_lock(&mem_lock);
+  zeroed = mem_arenas[arena].zeroed;
+  pthread_mutex_unlock(&mem_lock);
+  return zeroed;
+}
+
+/*
+ * mem_arena_lo - return address of the first byte of the given arena
+ *    (NULL if it has never been extended)
+ */
+void *mem_arena_lo(int arena)
+{
+  return (void *)mem_arenas[arena].start_brk;
+}
+
+/*
+ * mem_arena_hi - return address of the last byte of the given arena
+ */
+void *mem_arena_hi(int arena)
+{
+  return (void *)(mem_arenas[arena].brk - 1);
+}
+
+/*
+ * mem_in_heap - returns 1 if the bytes lo through hi lie within a
+ *    single arena, and 0 if not
+ */
+int mem_in_heap(void *lo, void *hi)
+{
+  int arena;
+
+  for (arena = 0; arena < MEM_MAX_ARENAS; arena++) {
+    if ((char *)lo >= mem_arenas[arena].start_brk &&
+        (char *)hi < mem_arenas[arena].brk)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes, summed over the
+ *    arenas
  */
 size_t mem_heapsize() 
 {
-  return (size_t)(mem_brk - mem_start_brk);
+  int arena;
+  size_t size = 0;
+
+  for (arena = 0; arena < MEM_MAX_ARENAS; arena++)
+    size += (size_t)(mem_arenas[arena].brk - mem_arenas[arena].start_brk);
+  return size;
 }
 
 /*
- * mem_pagesize() - returns the page size of the system
+ * mem_mapsize() - returns the total size in bytes of the mem_map regions
+ */
+size_t mem_mapsize()
+{
+  return mem_mapped;
+}
+
+/*
+ * mem_footprint() - returns the memory in use by the malloc package:
+ *    the heap plus every mem_map region
+ */
+size_t mem_footprint()
+{
+  return mem_heapsize() + mem_mapped;
+}
+
+/*
+ * mem_peak_footprint() - returns the largest mem_footprint() since the
+ *    last mem_reset_brk
+ */
+size_t mem_peak_footprint()
+{
+  return mem_peak;
+}
+
+/*
+ * mem_pagesize() - returns the granularity the heap should grow by:
+ *    the huge page size if the heap is on huge pages and memlib was
+ *    built with MEM_HUGE_GROWTH, and the page size of the system if not
  */
 size_t mem_pagesize()
+{
+  if (MEM_HUGE_GROWTH && mem_huge)
+    return MEM_HUGE_PAGE_SIZE;
+  return mem_syspagesize();
+}
+
+/*
+ * mem_syspagesize() - returns the page size of the system, the
+ *    granularity of mem_map regions
+ */
+size_t mem_syspagesize()
 {
   return (size_t)getpagesize();
 }
+
+/*
+ * mem_map - model of mmap for anonymous memory. Returns a new region of
+ *    size bytes (a multiple of the page size) outside the heap, or
+ *    (void *)-1 if there is no memory for it. The region is
+ *    page-aligned and zero-filled.
+ */
+void *mem_map(size_t size)
+{
+  mem_region_t *region;
+  void *lo;
+
+  assert(size % mem_syspagesize() == 0);
+  if ((region = (mem_region_t *)malloc(sizeof(mem_region_t))) == NULL)
+    return (void *)-1;
+  lo = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (lo == MAP_FAILED) {
+    fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+    free(region);
+    return (void *)-1;
+  }
+  region->lo = (char *)lo;
+  region->size = size;
+  pthread_mutex_lock(&mem_lock);
+  region->next = mem_regions;
+  mem_regions = region;
+  mem_mapped += size;
+  mem_update_peak();
+  pthread_mutex_unlock(&mem_lock);
+  return lo;
+}
+
+/*
+ * mem_unmap - model of munmap. Releases a whole region returned by
+ *    mem_map (or mem_remap). Returns 0 on success and -1 if addr and
+ *    size do not describe such a region.
+ */
+int mem_unmap(void *addr, size_t size)
+{
+  mem_region_t **link;
+  mem_region_t *region;
+
+  pthread_mutex_lock(&mem_lock);
+  link = mem_find_region(addr);
+  if (link == NULL || (*link)->size != size) {
+    pthread_mutex_unlock(&mem_lock);
+    errno = EINVAL;
+    fprintf(stderr, "ERROR: mem_unmap failed. Not a mapped region...\n");
+    return -1;
+  }
+  region = *link;
+  *link = region->next;
+  mem_mapped -= region->size;
+  pthread_mutex_unlock(&mem_lock);
+  munmap(region->lo, region->size);
+  free(region);
+  return 0;
+}
+
+/*
+ * mem_remap - model of mremap. Resizes the region at addr from old_size
+ *    to new_size bytes (both multiples of the page size), moving it if
+ *    needed, and returns its new address, or (void *)-1 on failure. The
+ *    contents are preserved up to the smaller of the two sizes, without
+ *    copying where the system can move the pages instead.
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size)
+{
+  mem_region_t **link;
+  void *lo;
+
+  assert(new_size % mem_syspagesize() == 0);
+  pthread_mutex_lock(&mem_lock);
+  link = mem_find_region(addr);
+  if (link == NULL || (*link)->size != old_size) {
+    pthread_mutex_unlock(&mem_lock);
+    errno = EINVAL;
+    fprintf(stderr, "ERROR: mem_remap failed. Not a mapped region...\n");
+    return (void *)-1;
+  }
+#ifdef MREMAP_MAYMOVE
+  lo = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+  if (lo == MAP_FAILED) {
+    pthread_mutex_unlock(&mem_lock);
+    fprintf(stderr, "ERROR: mem_remap failed. Ran out of memory...\n");
+    return (void *)-1;
+  }
+  (*link)->lo = (char *)lo;
+  (*link)->size = new_size;
+  mem_mapped = mem_mapped - old_size + new_size;
+  mem_update_peak();
+  pthread_mutex_unlock(&mem_lock);
+#else
+  pthread_mutex_unlock(&mem_lock);
+  if ((lo = mem_map(new_size)) == (void *)-1)
+    return (void *)-1;
+  memcpy(lo, addr, old_size < new_size ? old_size : new_size);
+  mem_unmap(addr, old_size);
+#endif
+  return lo;
+}
+
+/*
+ * mem_is_mapped - returns 1 if the bytes lo through hi lie within a
+ *    single mem_map region, and 0 if not
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+  mem_region_t *region;
+  int mapped = 0;
+
+  pthread_mutex_lock(&mem_lock);
+  for (region = mem_regions; region != NULL; region = region->next) {
+    if ((char *)lo >= region->lo && (char *)hi < region->lo + region->size) {
+      mapped = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mem_lock);
+  return mapped;
+}
+
+/*
+ * mem_reserve - give arena a an empty mem_max_heap region: a mapping
+ *    aligned to MEM_HUGE_PAGE_SIZE and advised onto huge pages if
+ *    possible, else storage from malloc. Returns 0 on success and -1
+ *    if there is no memory for it.
+ */
+static int mem_reserve(mem_arena_t *a)
+{
+  size_t size = mem_max_heap + MEM_HUGE_PAGE_SIZE;
+  char *lo, *start;
+
+  /* Over-reserve by a huge page, then unmap the slop on either side
+     of the first aligned mem_max_heap bytes */
+  lo = (char *)mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (lo != (char *)MAP_FAILED) {
+    start = (char *)(((size_t)lo + MEM_HUGE_PAGE_SIZE - 1) & ~(size_t)(MEM_HUGE_PAGE_SIZE - 1));
+    if (start > lo)
+      munmap(lo, start - lo);
+    munmap(start + mem_max_heap, lo + size - (start + mem_max_heap));
+#ifdef MADV_HUGEPAGE
+    if (madvise(start, mem_max_heap, MADV_HUGEPAGE) == 0)
+      mem_huge = 1;
+#endif
+    a->mapped = 1;
+    a->commit = start;
+    a->dirty = start;
+  }
+  else if ((start = (char *)malloc(mem_max_heap)) != NULL) {
+    a->mapped = 0;
+    a->commit = start + mem_max_heap;
+    a->dirty = a->commit;
+  }
+  else
+    return -1;
+
+  a->start_brk = start;
+  a->max_addr = start + mem_max_heap;  /* max legal heap address */
+  a->brk = start;                  /* heap is empty initially */
+  return 0;
+}
+
+/*
+ * mem_release - give back arena a's region, if it has one
+ */
+static void mem_release(mem_arena_t *a)
+{
+  if (a->start_brk != NULL) {
+    if (a->mapped)
+      munmap(a->start_brk, mem_max_heap);
+    else
+      free(a->start_brk);
+  }
+  a->start_brk = NULL;
+}
+
+/*
+ * mem_commit_step - the granularity pages are committed and decommitted
+ *    in: whole huge pages if the regions are on them, so as not to break
+ *    them up, or else pages of the system
+ */
+static size_t mem_commit_step(void)
+{
+  return mem_huge ? MEM_HUGE_PAGE_SIZE : mem_syspagesize();
+}
+
+/*
+ * mem_commit - make sure arena a's pages up to new_brk are committed.
+ *    Returns 0 on success and -1 if the system has no memory for them.
+ *    (call with mem_lock held)
+ */
+static int mem_commit(mem_arena_t *a, char *new_brk)
+{
+  size_t step = mem_commit_step();
+  char *end;
+
+  if (new_brk <= a->commit)
+    return 0;
+  end = a->start_brk + ((size_t)(new_brk - a->start_brk) + step - 1) / step * step;
+  if (end > a->max_addr)
+    end = a->max_addr;
+  if (mprotect(a->commit, end - a->commit, PROT_READ | PROT_WRITE) == -1)
+    return -1;
+  a->commit = end;
+  return 0;
+}
+
+/*
+ * mem_decommit - give arena a's whole pages above new_brk back to the
+ *    system (call with mem_lock held). MADV_FREE lets the system take
+ *    them back lazily, so a heap that soon grows again, as the drivers'
+ *    do after every mem_reset_brk, need not fault them all back in;
+ *    without it, MADV_DONTNEED drops them at once.
+ */
+static void mem_decommit(mem_arena_t *a, char *new_brk)
+{
+  size_t step = mem_commit_step();
+  char *end;
+
+  if (!a->mapped || a->start_brk == NULL)
+    return;
+  end = a->start_brk + ((size_t)(new_brk - a->start_brk) + step - 1) / step * step;
+  if (end >= a->commit)
+    return;
+#ifdef MADV_FREE
+  madvise(end, a->commit - end, MADV_FREE);
+#else
+  if (madvise(end, a->commit - end, MADV_DONTNEED) == 0 && a->dirty > end)
+    a->dirty = end;
+#endif
+  mprotect(end, a->commit - end, PROT_NONE);
+  a->commit = end;
+}
+
+/*
+ * mem_update_peak - record the current footprint if it is a new peak
+ *    (call with mem_lock held)
+ */
+static void mem_update_peak(void)
+{
+  if (mem_footprint() > mem_peak)
+    mem_peak = mem_footprint();
+}
+
+/*
+ * mem_find_region - returns the list link that points at the region
+ *    starting at addr, or NULL if there is no such region
+ */
+static mem_region_t **mem_find_region(void *addr)
+{
+  mem_region_t **link;
+
+  for (link = &mem_regions; *link != NULL; link = &(*link)->next) {
+    if ((*link)->lo == (char *)addr)
+      return link;
+  }
+  return NULL;
+}
@@ -1,11 +1,33 @@
 #include <unistd.h>
 
+/* Most arenas the simulated memory can hold (see mem_arena_sbrk) */
+#define MEM_MAX_ARENAS 16
+
 void mem_init(void);               
 void mem_deinit(void);
+void mem_set_max_heap(size_t size);
+size_t mem_max_heap_size(void);
+size_t mem_parse_size(const char *s);
 void *mem_sbrk(size_t incr);
+void *mem_trim(size_t decr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_arena_sbrk(int arena, size_t incr);
+void *mem_arena_trim(int arena, size_t decr);
+int mem_arena_zeroed(int arena);
+void *mem_arena_lo(int arena);
+void *mem_arena_hi(int arena);
+int mem_in_heap(void *lo, void *hi);
 size_t mem_heapsize(void);
+size_t mem_mapsize(void);
+size_t mem_footprint(void);
+size_t mem_peak_footprint(void);
 size_t mem_pagesize(void);
+size_t mem_syspagesize(void);
+
+void *mem_map(size_t size);
+int mem_unmap(void *addr, size_t size);
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+int mem_is_mapped(void *lo, void *hi);
 
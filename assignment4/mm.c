@@ -1,7 +1,8 @@
-/*-------------------------------------------------------------------                             
- * Lab 5 Starter code:                                                                            
- *        single doubly-linked free block list with LIFO policy                                   
- *        with support for coalescing adjacent free blocks  
+/*-------------------------------------------------------------------
+ * Lab 5 allocator:
+ *        segregated doubly-linked free block lists (one per size
+ *        class) with LIFO policy and support for coalescing
+ *        adjacent free blocks
  *
  * Terminology:
  * o We will implement an explicit free list allocator
@@ -11,10 +12,15 @@
  *   in memory.
  *-------------------------------------------------------------------- */
 
+#define _GNU_SOURCE  /* for sched_getcpu */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "memlib.h"
 #include "mm.h"
@@ -32,10 +38,143 @@
 #define UNSCALED_POINTER_ADD(p,x) ((void*)((char*)(p) + (x)))
 #define UNSCALED_POINTER_SUB(p,x) ((void*)((char*)(p) - (x)))
 
+/* Alignment of blocks returned by mm_malloc. */
+#define ALIGNMENT 8
+
 
 /******** FREE LIST IMPLEMENTATION ***********************************/
 
 
+/* Set COMPACT_LAYOUT to 1 (e.g. compile with -DCOMPACT_LAYOUT=1) to
+   use 32-bit headers and boundary tags, and 32-bit heap-relative
+   offsets instead of pointers for the free block links.  That halves
+   the per-block overhead: MIN_BLOCK_SIZE drops from 32 to 16 bytes,
+   so a 16-byte request no longer needs a 32-byte block.  In exchange,
+   the heap and every block in it must stay below 4 GB.
+
+   tag_t is the type of a header or boundary tag, and link_t the type
+   of a free block link.  Always read a link with FROM_LINK and write
+   one with TO_LINK, so the same code works with both layouts.  In the
+   compact layout, link 0 is NULL; offset 0 is the heap prologue,
+   which is never a block. */
+#ifndef COMPACT_LAYOUT
+#define COMPACT_LAYOUT 0
+#endif
+
+#if COMPACT_LAYOUT
+typedef uint32_t tag_t;
+typedef uint32_t link_t;
+#define TO_LINK(p) ((p) == NULL ? 0 : (link_t)((char*)(p) - heapBase))
+#define FROM_LINK(l) ((l) == 0 ? NULL : (void*)(heapBase + (l)))
+#else
+typedef size_t tag_t;
+typedef void* link_t;
+#define TO_LINK(p) ((link_t)(p))
+#define FROM_LINK(l) ((void*)(l))
+#endif
+
+/* Set MM_THREAD_SAFE to 1 (e.g. compile with -DMM_THREAD_SAFE=1) to
+   make mm_malloc, mm_free and mm_realloc safe to call from several
+   threads at once.  Each arena (see below) has a lock that guards its
+   heap and everything in its prologue; each public entry point takes
+   the lock of the arena it works on around the same single-threaded
+   code as always.  In front of the locks, a per-thread cache (see
+   THREAD CACHES) serves the common malloc/free pair without taking
+   one.  mm_init must still not run alongside other calls.
+
+   The few fields read without a lock (an arena's bounds, the run map,
+   and the header of a block being freed) are read with ATOMIC_LOAD and
+   written with ATOMIC_STORE, ATOMIC_OR or ATOMIC_AND, and the one
+   counter every thread updates (mappedLiveBytes) with ATOMIC_ADD;
+   without MM_THREAD_SAFE those are plain accesses.  A used block's
+   header only changes when a neighbor flips its TAG_PRECEDING_USED
+   bit, so that is the one header update that must be atomic. */
+#ifndef MM_THREAD_SAFE
+#define MM_THREAD_SAFE 0
+#endif
+
+#if MM_THREAD_SAFE
+#define THREAD_LOCAL __thread
+#define ATOMIC_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define ATOMIC_OR(x, v) __atomic_fetch_or(&(x), (v), __ATOMIC_RELAXED)
+#define ATOMIC_AND(x, v) __atomic_fetch_and(&(x), (v), __ATOMIC_RELAXED)
+#define ATOMIC_ADD(x, v) __atomic_fetch_add(&(x), (v), __ATOMIC_RELAXED)
+#else
+#define THREAD_LOCAL
+#define ATOMIC_LOAD(x) (x)
+#define ATOMIC_STORE(x, v) ((x) = (v))
+#define ATOMIC_OR(x, v) ((x) |= (v))
+#define ATOMIC_AND(x, v) ((x) &= (v))
+#define ATOMIC_ADD(x, v) ((x) += (v))
+#endif
+
+
+/* Set MM_ARENAS above 1 (with MM_THREAD_SAFE, e.g. -DMM_ARENAS=4) to
+   split the allocator into that many arenas.  Each arena is a heap of
+   its own in its own memlib region (see mem_arena_sbrk), with its own
+   prologue (and so its own free lists, tree and slab runs) and its own
+   lock, so threads working in different arenas never contend.  A
+   thread is given an arena round robin the first time it allocates;
+   with ARENA_BY_CPU set to 1, each allocation instead uses the arena
+   of the CPU it runs on.  Either way, a block goes back to the arena
+   it came from: mm_free finds the arena whose bounds hold its address.
+
+   A thread freeing a block of some other thread's arena does not take
+   that arena's lock.  It pushes the block, linked through the first
+   word of its payload, onto the arena's remoteFrees list with a
+   compare-and-swap.  Whoever enters the arena next (usually its own
+   thread, on its next mm_malloc) takes the whole list with one
+   exchange and frees the blocks in a batch.  Until then they stay
+   marked used.  Since the list is only ever taken whole, the pushes
+   cannot suffer from ABA.
+
+   The heap code always works on the current arena, set by enterArena:
+   heapBase (and so PROLOGUE) refer to it.  With MM_THREAD_SAFE both
+   are per thread, and a thread only enters an arena while holding its
+   lock.  mm_init sets up arena 0; the others are set up the first
+   time a thread enters them. */
+#ifndef MM_ARENAS
+#define MM_ARENAS 1
+#endif
+#ifndef ARENA_BY_CPU
+#define ARENA_BY_CPU 0
+#endif
+#if MM_ARENAS > 1 && !MM_THREAD_SAFE
+#error "MM_ARENAS above 1 needs MM_THREAD_SAFE"
+#endif
+#if MM_ARENAS > MEM_MAX_ARENAS
+#error "MM_ARENAS is larger than memlib's MEM_MAX_ARENAS"
+#endif
+
+struct Arena {
+  // First byte of the arena's heap (NULL until the arena is set up),
+  // and one past its last byte, kept up to date wherever the heap
+  // grows or shrinks.
+  char* base;
+  char* end;
+  // Every byte from here to the heap-footer is zero, but for the links
+  // and boundary tag of the free block it lies in (see heapCalloc).
+  char* zeroStart;
+#if MM_THREAD_SAFE
+  pthread_mutex_t lock;
+  // Blocks freed by threads working in other arenas.
+  void* remoteFrees;
+#endif
+};
+typedef struct Arena Arena;
+
+static Arena arenas[MM_ARENAS];
+
+/* The arena the thread is working in, and its first byte, cached so
+   converting a link does not need to go through curArena. */
+static THREAD_LOCAL Arena* curArena;
+static THREAD_LOCAL char* heapBase;
+
+/* Index of the current arena, for the mem_arena_* calls. */
+#define ARENA_INDEX ((int)(curArena - arenas))
+
+
 /* A BlockInfo contains information about a block, including the size
    and usage tags, as well as pointers to the next and previous blocks
    in the free list.  This is exactly the "explicit free list" structure
@@ -66,34 +205,337 @@ struct BlockInfo {
   // Size of the block (in the high bits) and tags for whether the
   // block and its predecessor in memory are in use.  See the SIZE()
   // and TAG macros, below, for more details.
-  size_t sizeAndTags;
-  // Pointer to the next block in the free list.
-  struct BlockInfo* next;
-  // Pointer to the previous block in the free list.
-  struct BlockInfo* prev;
+  tag_t sizeAndTags;
+  // Link to the next block in the free list.
+  link_t next;
+  // Link to the previous block in the free list.
+  link_t prev;
 };
 typedef struct BlockInfo BlockInfo;
 
+/* Follow the free list links of a block. */
+#define NEXT_FREE(block) ((BlockInfo*)FROM_LINK((block)->next))
+#define PREV_FREE(block) ((BlockInfo*)FROM_LINK((block)->prev))
 
-/* Pointer to the first BlockInfo in the free list, the list's head. 
-   
-   A pointer to the head of the free list in this implementation is
-   always stored in the first word in the heap.  mem_heap_lo() returns
-   a pointer to the first word in the heap, so we cast the result of
-   mem_heap_lo() to a BlockInfo** (a pointer to a pointer to
-   BlockInfo) and dereference this to get a pointer to the first
-   BlockInfo in the free list. */
-#define FREE_LIST_HEAD *((BlockInfo **)mem_heap_lo())
 
-/* Size of a word on this architecture. */
-#define WORD_SIZE sizeof(void*)
+/* Free blocks of at least LARGE_BLOCK_SIZE bytes are not kept on the
+   size class lists.  They are kept in a splay tree ordered by size
+   (and by address among blocks of the same size, so every key is
+   unique), which gives amortized O(log n) best-fit lookups.  The tree
+   links live in the free payload right after the BlockInfo fields:
+
+   +--------------+
+   | sizeAndTags  |  <-  TreeBlock pointers in the tree point here
+   +--------------+
+   |  next, prev  |      (unused while the block is in the tree)
+   +--------------+
+   |     left     |
+   +--------------+
+   |    right     |
+   +--------------+
+   |     ...      |
+   +--------------+
+   | boundary tag |
+   +--------------+
+*/
+struct TreeBlock {
+  // Header and (unused) free list links.
+  BlockInfo info;
+  // Subtree of blocks ordered before this one.
+  link_t left;
+  // Subtree of blocks ordered after this one.
+  link_t right;
+};
+typedef struct TreeBlock TreeBlock;
+
+/* Follow the tree links of a block. */
+#define LEFT(node) ((TreeBlock*)FROM_LINK((node)->left))
+#define RIGHT(node) ((TreeBlock*)FROM_LINK((node)->right))
+
+
+/* Free blocks smaller than LARGE_BLOCK_SIZE are kept on
+   NUM_SIZE_CLASSES separate lists, indexed
+   with a two-level scheme as in TLSF (two-level segregated fit).  The
+   first level is the power of two just below the block size, starting
+   at MIN_BLOCK_SIZE; the second level splits each power-of-two range
+   into SUBCLASSES_PER_LEVEL equal slices.  For example, with
+   MIN_BLOCK_SIZE == 32, classes 0-3 hold blocks of size 32-39, 40-47,
+   48-55 and 56-63, and classes 4-7 hold 64-79, 80-95, 96-111 and
+   112-127.  NUM_SIZE_CLASSES is enough to reach LARGE_BLOCK_SIZE from
+   any MIN_BLOCK_SIZE of 16 or more. */
+#define SUBCLASS_BITS 2
+#define SUBCLASSES_PER_LEVEL (1 << SUBCLASS_BITS)
+#define NUM_SIZE_CLASSES 24
+#if MM_STATS_CLASSES != NUM_SIZE_CLASSES + 1
+#error "MM_STATS_CLASSES in mm.h must be NUM_SIZE_CLASSES + 1"
+#endif
+
+/* Free blocks this size or larger go in the splay tree instead of the
+   size class lists.  Must be a power of two. */
+#define LARGE_BLOCK_SIZE 1024
+
+/* Requests of at most SLAB_MAX_SIZE bytes do not get blocks of their
+   own.  Each is rounded up to a multiple of ALIGNMENT, its slab class,
+   and served from a run: a RUN_SIZE-byte, RUN_SIZE-aligned region of
+   equal-sized objects of one class, with no header per object.  The
+   run itself is an ordinary allocated block, so the rest of the heap
+   (coalescing, boundary tags) is unaware of it.
+
+   +------------------+
+   |   block header   |  <-  header of the run's block, just before
+   +------------------+      the RUN_SIZE boundary
+   |  SlabRun fields  |  <-  SlabRun pointers point here
+   |  and free map    |
+   +------------------+
+   |     object 0     |
+   |     object 1     |
+   |       ...        |
+   +------------------+
+   |   block header   |  <-  header of the following block
+   +------------------+
+
+   The run's block is exactly RUN_SIZE bytes, so its last TAG_SIZE
+   bytes of the page hold the following block's header, and runs carved
+   one after another from a free block pack with no gaps.
+
+   A run's free map has one bit per object, set while the object is
+   free, so allocating or freeing an object is a few bit operations.
+   mm_free finds an object's run by masking off the low bits of its
+   address.  The run map, with one bit per RUN_SIZE page of the heap,
+   tells it whether an address lies in a run at all.  The run map is
+   an ordinary allocated block, created with the first run and doubled
+   whenever a run lands past its end. */
+#define RUN_SIZE 4096
+#define SLAB_MAX_SIZE 128
+#define NUM_SLAB_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)
+#define SLAB_CLASS(size) (((size) + ALIGNMENT - 1) / ALIGNMENT - 1)
+#define FREE_MAP_WORDS (RUN_SIZE / ALIGNMENT / 64)
+
+struct SlabRun {
+  // Links in the list of runs of this class with a free object.
+  link_t nextRun;
+  link_t prevRun;
+  // Size of each object and number of objects in the run.
+  uint32_t objectSize;
+  uint32_t numObjects;
+  // Number of free objects.
+  uint32_t numFree;
+  // Bit i is set if and only if object i is free.
+  uint64_t freeMap[FREE_MAP_WORDS];
+};
+typedef struct SlabRun SlabRun;
+
+#define NEXT_RUN(run) ((SlabRun*)FROM_LINK((run)->nextRun))
+#define PREV_RUN(run) ((SlabRun*)FROM_LINK((run)->prevRun))
+
+/* With deferred coalescing turned on (see mm_defer_coalescing), mm_free
+   does not free heap blocks smaller than QUICK_MAX_SIZE.  It pushes
+   them, still marked used, onto the quick list for their exact size,
+   linked through their next field.  A request for a block of that size
+   pops one straight back, with no search, split or coalesce.  The
+   quick lists are emptied, and their blocks freed and coalesced in one
+   batch, when they hold more than QUICK_FLUSH_THRESHOLD blocks or when
+   an allocation finds no free block large enough.  The table of
+   quick list heads is an ordinary allocated block, made the first
+   time mm_free defers a block, so heaps that never defer do without
+   it.
+
+   mm_defer_coalescing sets deferRequested, and mm_init copies it into
+   deferCoalescing, so a heap keeps the setting it started with and
+   never holds quick list blocks it would not look at. */
+#define QUICK_MAX_SIZE 512
+#define NUM_QUICK_BINS (QUICK_MAX_SIZE / ALIGNMENT)
+#define QUICK_BIN(size) ((size) / ALIGNMENT)
+#define QUICK_FLUSH_THRESHOLD 128
+
+static int deferRequested = 0;
+static int deferCoalescing = 0;
+
+/* With PRECARVE set to 1 (e.g. compile with -DPRECARVE=1), the heap
+   keeps a small online histogram of the block sizes that mm_malloc
+   asks it for: a space-saving table of NUM_HOT_SIZES
+   entries, each a size and an estimate of how often it was requested.
+   A size missing from the table takes over the entry with the lowest
+   count, and that count plus one, so sizes that keep coming back stay
+   in the table.  Once a size has been counted PRECARVE_MIN_COUNT times
+   it is hot.  Whenever the heap grows for an allocation, up to
+   PRECARVE_COUNT blocks of the hottest size (if it is at most
+   PRECARVE_MAX_SIZE bytes) are carved, marked used, from the free
+   space left past the allocated block and parked on that entry's
+   pool.  A later request for that size pops one with no search or
+   split.  A pool goes back to the free lists when its size drops out
+   of the table.  Since most requests reuse freed blocks rather than
+   grow the heap, it pays off mainly for programs that keep growing the
+   heap with a few sizes; it is off by default, which keeps the table
+   out of the prologue. */
+#ifndef PRECARVE
+#define PRECARVE 0
+#endif
+#define NUM_HOT_SIZES 4
+#define PRECARVE_MIN_COUNT 32
+#define PRECARVE_COUNT 8
+#define PRECARVE_MAX_SIZE 1024
+
+struct HotSize {
+  // Block size, and how often it was requested (as estimated).
+  uint32_t size;
+  uint32_t count;
+  // Pre-carved blocks of this size, linked through their next field.
+  link_t pool;
+};
+typedef struct HotSize HotSize;
+
+/* With MM_STATS set to 1 (e.g. compile with -DMM_STATS=1), each heap
+   keeps an mm_stats_t of counters (see mm.h) in its prologue, updated
+   with plain increments where the events happen: free bytes and free
+   blocks per size class on every insertFreeBlock and removeFreeBlock,
+   live bytes and allocations per size class wherever a heap block or
+   slab object is handed out or given back, splits, coalesces, free
+   list searches and the blocks they look at, and heap growth.  Live
+   bytes are the usable bytes of the blocks handed out, so slab runs'
+   slack, quick lists, pre-carved pools and the heap's own metadata
+   are not in them.  A block in a thread's tcache still counts as
+   live, and one taken from there is not counted as an allocation
+   again.  Mapped blocks belong to no heap and are freed without a
+   lock, so their live bytes are kept in mappedLiveBytes instead.
+   The counters sit on cache lines of their own wherever heapBase
+   falls (see HEAP_STATS), so they never share a line with the free
+   list heads.  mm_stats adds them up over the arenas. */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
+#define CACHE_LINE_SIZE 64
+
+/* Bytes the prologue sets aside for the stats: whole cache lines, and
+   enough to start them at the first line boundary inside. */
+#define STATS_SPACE \
+  (CACHE_LINE_SIZE * ((sizeof(mm_stats_t) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) + \
+   CACHE_LINE_SIZE - 1)
+
+/* The current heap's stats. */
+#define HEAP_STATS \
+  ((mm_stats_t*)(((uintptr_t)PROLOGUE->statsSpace + CACHE_LINE_SIZE - 1) & \
+                 ~(uintptr_t)(CACHE_LINE_SIZE - 1)))
+
+#if MM_STATS
+#define STAT_ADD(field, n) (HEAP_STATS->field += (n))
+#define STAT_SUB(field, n) (HEAP_STATS->field -= (n))
+/* Count a block or object with 'usable' bytes being handed out, given
+   back, or resized in place from oldUsable to newUsable bytes. */
+#define STAT_ALLOCATED(usable) \
+  (STAT_ADD(liveBytes, (usable)), \
+   STAT_ADD(allocations[STAT_CLASS(requestSize(usable))], 1))
+#define STAT_FREED(usable) STAT_SUB(liveBytes, (usable))
+#define STAT_RESIZED(oldUsable, newUsable) \
+  (STAT_SUB(liveBytes, (oldUsable)), STAT_ADD(liveBytes, (newUsable)))
+#else
+#define STAT_ADD(field, n)
+#define STAT_SUB(field, n)
+#define STAT_ALLOCATED(usable)
+#define STAT_FREED(usable)
+#define STAT_RESIZED(oldUsable, newUsable)
+#endif
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+/* Index into mm_stats_t's freeBlocks and allocations of a block of
+   the given size: its size class, or the last one for the large
+   tree's sizes. */
+#define STAT_CLASS(blockSize) \
+  ((blockSize) >= LARGE_BLOCK_SIZE ? NUM_SIZE_CLASSES : sizeClass(blockSize))
+
+#if MM_STATS
+// Usable bytes of the mapped blocks handed out and not yet freed.
+static size_t mappedLiveBytes;
+#define STAT_MAPPED(usable) ATOMIC_ADD(mappedLiveBytes, (usable))
+#define STAT_UNMAPPED(usable) ATOMIC_ADD(mappedLiveBytes, -(size_t)(usable))
+#else
+#define STAT_MAPPED(usable)
+#define STAT_UNMAPPED(usable)
+#endif
+
+/* The heap prologue sits in the first words of the heap, before the
+   first block.  It holds the head of each size class's free list and
+   a bitmap with bit i set exactly when list i is non-empty, so
+   searchFreeList can jump straight to a usable list with a single
+   count-trailing-zeros instead of probing empty lists one by one.
+   It also holds the root of the splay tree of large free blocks, the
+   lists of slab runs with free objects, and the location of the run
+   map.
+   heapBase points to the first word in the current arena's heap, so
+   we cast it to a HeapPrologue* to get at these fields. */
+struct HeapPrologue {
+  // Pointer to the first BlockInfo in each size class's free list.
+  struct BlockInfo* freeListHeads[NUM_SIZE_CLASSES];
+  // Bit i is set if and only if freeListHeads[i] != NULL.
+  uint64_t nonEmptyClasses;
+  // Root of the splay tree of free blocks of at least LARGE_BLOCK_SIZE.
+  struct TreeBlock* largeTreeRoot;
+  // Where the next next fit search of the rover's list starts.
+  struct BlockInfo* rover;
+  // Runs with at least one free object, per slab class.
+  struct SlabRun* slabRuns[NUM_SLAB_CLASSES];
+  // Bit i of the run map is set if and only if the i-th RUN_SIZE page
+  // of the heap (counting from the page holding the heap's first
+  // byte) is a run.  NULL until the first run is made.
+  uint64_t* runMap;
+  size_t runMapWords;
+  // Number of mm_realloc calls that kept the block in place, and
+  // number that moved it.
+  size_t reallocInPlace;
+  size_t reallocCopied;
+  // Head of the quick list of each block size (NULL until the first
+  // block is deferred), bit i set if and only if quick list i is
+  // non-empty, and number of blocks on all of them.
+  link_t* quickLists;
+  uint64_t nonEmptyQuickLists;
+  size_t quickCount;
+#if PRECARVE
+  // Histogram of requested block sizes and their pre-carved pools, and
+  // number of requests that looked in a pool and that found a block.
+  HotSize hotSizes[NUM_HOT_SIZES];
+  size_t precarveRequests;
+  size_t precarveHits;
+#endif
+#if MM_STATS
+  // Room for the allocator statistics (see HEAP_STATS).
+  char statsSpace[STATS_SPACE];
+#endif
+};
+typedef struct HeapPrologue HeapPrologue;
+
+#define PROLOGUE ((HeapPrologue *)heapBase)
 
-/* Minimum block size (to account for size header, next ptr, prev ptr,
-   and boundary tag) */
-#define MIN_BLOCK_SIZE (sizeof(BlockInfo) + WORD_SIZE)
+/* Head of the free list for the given size class. */
+#define FREE_LIST_HEAD(sizeClass) (PROLOGUE->freeListHeads[sizeClass])
 
-/* Alignment of blocks returned by mm_malloc. */
-#define ALIGNMENT 8
+/* Occupancy bitmap of the free lists. */
+#define NON_EMPTY_CLASSES (PROLOGUE->nonEmptyClasses)
+
+/* Root of the large free block tree. */
+#define LARGE_TREE_ROOT (PROLOGUE->largeTreeRoot)
+
+/* Head of the list of runs with free objects for a slab class. */
+#define SLAB_RUN_HEAD(slabClass) (PROLOGUE->slabRuns[slabClass])
+
+/* Index of the run map bit covering address p. */
+#define RUN_MAP_INDEX(p) ((uintptr_t)(p) / RUN_SIZE - (uintptr_t)heapBase / RUN_SIZE)
+
+/* Size of a block header or boundary tag. */
+#define TAG_SIZE sizeof(tag_t)
+
+/* Minimum block size (to account for size header, next link, prev
+   link, and boundary tag) */
+#define MIN_BLOCK_SIZE (sizeof(BlockInfo) + TAG_SIZE)
+
+/* Largest block size a header can hold. */
+#define MAX_BLOCK_SIZE SIZE((tag_t)-1)
+
+/* Offset of the first block from the start of the heap.  Payloads
+   start TAG_SIZE bytes into a block and must be ALIGNMENT-aligned, so
+   this is the end of the heap prologue rounded up to where the next
+   aligned payload's header would go. */
+#define FIRST_BLOCK_OFFSET \
+  (ALIGNMENT * ((sizeof(HeapPrologue) + TAG_SIZE + ALIGNMENT - 1) / ALIGNMENT) - TAG_SIZE)
 
 /* SIZE(blockInfo->sizeAndTags) extracts the size of a 'sizeAndTags' field.
    Also, calling SIZE(size) selects just the higher bits of 'size' to ensure
@@ -108,10 +550,12 @@ typedef struct BlockInfo BlockInfo;
       high bit                               low bit
 
    Since ALIGNMENT == 8, we reserve the low 3 bits of sizeAndTags for tag
-   bits, and we use bits 3-63 to store the size.
+   bits, and we use bits 3-63 to store the size (bits 3-31 with
+   COMPACT_LAYOUT).
 
    Bit 0 (2^0 == 1): TAG_USED
    Bit 1 (2^1 == 2): TAG_PRECEDING_USED
+   Bit 2 (2^2 == 4): TAG_REALLOCED
 */
 #define SIZE(x) ((x) & ~(ALIGNMENT - 1))
 
@@ -124,56 +568,526 @@ typedef struct BlockInfo BlockInfo;
    of the previous block from its boundary tag */
 #define TAG_PRECEDING_USED 2
 
+/* TAG_REALLOCED marks a used block that mm_realloc has grown at least
+   once.  Such blocks tend to keep growing, so mm_realloc reserves
+   headroom past their requested size (see reallocHeadroom).  Free
+   blocks never carry this tag. */
+#define TAG_REALLOCED 4
+
+/* Headroom policy for blocks that keep growing: reserve 1/2^SHIFT of
+   the requested size past its end, capped at REALLOC_HEADROOM_MAX
+   bytes.  The last block in the heap never needs headroom, since it
+   can always grow in place by growing the heap. */
+#define REALLOC_HEADROOM_SHIFT 3
+#define REALLOC_HEADROOM_MAX (16 * 1024)
+
+/* When the free block at the end of the heap reaches TRIM_THRESHOLD
+   bytes, trimHeap hands all but TRIM_PAD bytes of it (rounded to whole
+   pages) back to memlib.  The gap between the two keeps a heap that
+   hovers around one size from trimming and regrowing on every
+   malloc/free pair. */
+#define TRIM_THRESHOLD (128 * 1024)
+#define TRIM_PAD (16 * 1024)
+
+/* Requests of at least MMAP_THRESHOLD bytes (override with e.g.
+   -DMMAP_THRESHOLD=65536) skip the heap: each gets a region of its own
+   from mem_map, which goes straight back with mem_unmap when freed.
+   Huge blocks then never fragment the heap, never sit in the free
+   lists and never take part in coalescing.  A mapped block is a
+   MappedHeader followed by the payload; it is told apart from heap
+   blocks by its address, which lies outside the heap. */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+struct MappedHeader {
+  // Size of the whole region, header included.
+  size_t mapSize;
+};
+typedef struct MappedHeader MappedHeader;
+
+/* Size of a MappedHeader, padded so the payload is aligned. */
+#define MAPPED_HEADER_SIZE \
+  (ALIGNMENT * ((sizeof(MappedHeader) + ALIGNMENT - 1) / ALIGNMENT))
+
+
+/* Size class of a block of the given size (see NUM_SIZE_CLASSES).
+   The first level is floor(log2(blockSize)) relative to
+   MIN_BLOCK_SIZE, and the second level is the SUBCLASS_BITS bits just
+   below the leading one. */
+static int sizeClass(size_t blockSize) {
+  int log2Size = (int)(8 * sizeof(long) - 1 - __builtin_clzl(blockSize));
+  int level = log2Size - (int)(8 * sizeof(long) - 1 - __builtin_clzl(MIN_BLOCK_SIZE));
+  int subclass = (int)(blockSize >> (log2Size - SUBCLASS_BITS)) & (SUBCLASSES_PER_LEVEL - 1);
+  int sizeClass = level * SUBCLASSES_PER_LEVEL + subclass;
+  return (sizeClass < NUM_SIZE_CLASSES) ? sizeClass : NUM_SIZE_CLASSES - 1;
+}
 
-/* Find a free block of the requested size in the free list.  Returns
-   NULL if no free block is large enough. */
-static void * searchFreeList(size_t reqSize) {   
-  BlockInfo* freeBlock;
+/* Compare the tree key (size, address) against the key of node.
+   Returns a negative number, zero or a positive number if the key
+   orders before, at or after the node. */
+static int compareTreeKey(size_t size, void* address, TreeBlock* node) {
+  size_t nodeSize = SIZE(node->info.sizeAndTags);
+  if (size != nodeSize) {
+    return (size < nodeSize) ? -1 : 1;
+  }
+  if (address != (void*)node) {
+    return (address < (void*)node) ? -1 : 1;
+  }
+  return 0;
+}
 
-  freeBlock = FREE_LIST_HEAD;
-  while (freeBlock != NULL){
-    if (SIZE(freeBlock->sizeAndTags) >= reqSize) {
-      return freeBlock;
+/* Top-down splay (Sleator and Tarjan) of the tree rooted at root
+   around the key (size, address).  Returns the new root, which is the
+   node with that key if there is one, and otherwise the node just
+   before or just after where the key would go. */
+static TreeBlock* splayTree(TreeBlock* root, size_t size, void* address) {
+  // header.right collects the left tree and header.left the right tree.
+  TreeBlock header;
+  TreeBlock *leftTreeMax, *rightTreeMin, *child;
+  int cmp;
+
+  if (root == NULL) {
+    return NULL;
+  }
+  header.left = header.right = TO_LINK(NULL);
+  leftTreeMax = rightTreeMin = &header;
+
+  while ((cmp = compareTreeKey(size, address, root)) != 0) {
+    if (cmp < 0) {
+      if (LEFT(root) == NULL) {
+        break;
+      }
+      if (compareTreeKey(size, address, LEFT(root)) < 0) {
+        // Rotate right.
+        child = LEFT(root);
+        root->left = child->right;
+        child->right = TO_LINK(root);
+        root = child;
+        if (LEFT(root) == NULL) {
+          break;
+        }
+      }
+      // Link right.
+      rightTreeMin->left = TO_LINK(root);
+      rightTreeMin = root;
+      root = LEFT(root);
     } else {
-      freeBlock = freeBlock->next;
+      if (RIGHT(root) == NULL) {
+        break;
+      }
+      if (compareTreeKey(size, address, RIGHT(root)) > 0) {
+        // Rotate left.
+        child = RIGHT(root);
+        root->right = child->left;
+        child->left = TO_LINK(root);
+        root = child;
+        if (RIGHT(root) == NULL) {
+          break;
+        }
+      }
+      // Link left.
+      leftTreeMax->right = TO_LINK(root);
+      leftTreeMax = root;
+      root = RIGHT(root);
     }
   }
-  return NULL;
+
+  // Reassemble.
+  leftTreeMax->right = root->left;
+  rightTreeMin->left = root->right;
+  root->left = header.right;
+  root->right = header.left;
+  return root;
+}
+
+/* Find the smallest block in the large tree of at least reqSize
+   bytes.  Returns NULL if no block in the tree is large enough. */
+static TreeBlock* searchLargeTree(size_t reqSize) {
+  TreeBlock* node;
+
+  if (LARGE_TREE_ROOT == NULL) {
+    return NULL;
+  }
+  // No block has a NULL address, so this key orders before every
+  // block of size reqSize.
+  LARGE_TREE_ROOT = splayTree(LARGE_TREE_ROOT, reqSize, NULL);
+  node = LARGE_TREE_ROOT;
+  if (SIZE(node->info.sizeAndTags) >= reqSize) {
+    return node;
+  }
+
+  // The root is the largest block that is too small, so the best fit
+  // is the smallest block in its right subtree.
+  node = RIGHT(node);
+  if (node != NULL) {
+    while (LEFT(node) != NULL) {
+      node = LEFT(node);
+    }
+  }
+  return node;
+}
+
+/* Insert a large free block into the tree. */
+static void insertTreeBlock(TreeBlock* freeBlock) {
+  size_t size = SIZE(freeBlock->info.sizeAndTags);
+  TreeBlock* root = LARGE_TREE_ROOT;
+
+  if (root == NULL) {
+    freeBlock->left = freeBlock->right = TO_LINK(NULL);
+  } else {
+    // Split the tree around the new key and hang both halves off the
+    // new block, which becomes the root.
+    root = splayTree(root, size, freeBlock);
+    if (compareTreeKey(size, freeBlock, root) < 0) {
+      freeBlock->left = root->left;
+      freeBlock->right = TO_LINK(root);
+      root->left = TO_LINK(NULL);
+    } else {
+      freeBlock->right = root->right;
+      freeBlock->left = TO_LINK(root);
+      root->right = TO_LINK(NULL);
+    }
+  }
+  LARGE_TREE_ROOT = freeBlock;
+}
+
+/* Remove a large free block from the tree. */
+static void removeTreeBlock(TreeBlock* freeBlock) {
+  size_t size = SIZE(freeBlock->info.sizeAndTags);
+  TreeBlock* root = splayTree(LARGE_TREE_ROOT, size, freeBlock);
+
+  // freeBlock is now the root.  Join its subtrees: splaying the left
+  // subtree around freeBlock's key brings its largest node to the top,
+  // and that node has no right child.
+  if (LEFT(root) == NULL) {
+    LARGE_TREE_ROOT = RIGHT(root);
+  } else {
+    LARGE_TREE_ROOT = splayTree(LEFT(root), size, freeBlock);
+    LARGE_TREE_ROOT->right = root->right;
+  }
+}
+
+/* Set MM_CHECK to 1 (e.g. compile with -DMM_CHECK=1) to check the
+   heap incrementally: each block that an mm_malloc, mm_free or
+   mm_realloc call put on a free list, allocated or resized is noted
+   with TOUCH_BLOCK (and forgotten again with UNTOUCH_BLOCK if a later
+   step of the same call merged it away), and when the call leaves its
+   arena, checkBlock looks at just those blocks and their neighbors.
+   That costs a few loads per block, so it can stay on in staging
+   builds.  A call that touches more than MAX_TOUCHED blocks (flushing
+   the quick lists, say) gets the full mm_check instead, and with
+   MM_CHECK set to 2 every call does.  An inconsistent heap stops the
+   program. */
+#ifndef MM_CHECK
+#define MM_CHECK 0
+#endif
+#define MAX_TOUCHED 256
+
+#if MM_CHECK
+static THREAD_LOCAL BlockInfo* touchedBlocks[MAX_TOUCHED];
+// Number of entries in touchedBlocks, or MAX_TOUCHED + 1 if more
+// blocks than that were touched.
+static THREAD_LOCAL int numTouched;
+
+static void touchBlock(BlockInfo* block) {
+  int i;
+
+  for (i = 0; i < numTouched && i < MAX_TOUCHED; i++) {
+    if (touchedBlocks[i] == block) {
+      return;
+    }
+  }
+  if (numTouched < MAX_TOUCHED) {
+    touchedBlocks[numTouched++] = block;
+  } else {
+    numTouched = MAX_TOUCHED + 1;
+  }
+}
+
+static void untouchBlock(BlockInfo* block) {
+  int i;
+
+  for (i = 0; i < numTouched && i < MAX_TOUCHED; i++) {
+    if (touchedBlocks[i] == block) {
+      if (numTouched <= MAX_TOUCHED) {
+        touchedBlocks[i] = touchedBlocks[--numTouched];
+      }
+      return;
+    }
+  }
+}
+
+#define TOUCH_BLOCK(block) touchBlock(block)
+#define UNTOUCH_BLOCK(block) untouchBlock(block)
+#else
+#define TOUCH_BLOCK(block)
+#define UNTOUCH_BLOCK(block)
+#endif
+
+/* The policies for the size class lists are chosen when mm.c is
+   built, with MM_PLACEMENT, MM_INSERTION and MM_GOOD_FIT_CANDIDATES
+   (e.g. compile with -DMM_PLACEMENT=MM_BEST_FIT
+   -DMM_INSERTION=MM_ADDRESS_ORDERED).  Each policy is its own static
+   inline function, and fitInList and insertInList are just the one
+   the build picked, so searches and inserts never test the policy.
+
+   fitInList picks a block of at least reqSize bytes from the list
+   starting at 'block', or returns NULL:
+   o first fit takes the first block that fits;
+   o next fit does the same, but starts where the last next fit
+     search in the same list left off (the rover) and wraps around;
+   o best fit takes the smallest block that fits;
+   o good fit takes the smallest block that fits among the first
+     MM_GOOD_FIT_CANDIDATES blocks of the list.  With 1 candidate, the
+     default, only the head is tried, so every search takes constant
+     time.
+
+   insertInList puts a block at the head of its list (LIFO, the
+   default) or keeps each list sorted by address.  The large tree is
+   always best fit, and ordered by size and address. */
+#ifndef MM_PLACEMENT
+#define MM_PLACEMENT MM_GOOD_FIT
+#endif
+#ifndef MM_INSERTION
+#define MM_INSERTION MM_LIFO
+#endif
+#ifndef MM_GOOD_FIT_CANDIDATES
+#define MM_GOOD_FIT_CANDIDATES 1
+#endif
+
+#if MM_PLACEMENT != MM_FIRST_FIT && MM_PLACEMENT != MM_NEXT_FIT && \
+    MM_PLACEMENT != MM_BEST_FIT && MM_PLACEMENT != MM_GOOD_FIT
+#error "MM_PLACEMENT must be MM_FIRST_FIT, MM_NEXT_FIT, MM_BEST_FIT or MM_GOOD_FIT"
+#endif
+#if MM_INSERTION != MM_LIFO && MM_INSERTION != MM_ADDRESS_ORDERED
+#error "MM_INSERTION must be MM_LIFO or MM_ADDRESS_ORDERED"
+#endif
+#if MM_GOOD_FIT_CANDIDATES < 1
+#error "MM_GOOD_FIT_CANDIDATES must be at least 1"
+#endif
+
+static inline BlockInfo* firstFit(BlockInfo* block, size_t reqSize) {
+  for (; block != NULL; block = NEXT_FREE(block)) {
+    STAT_INC(searchSteps);
+    if (SIZE(block->sizeAndTags) >= reqSize) {
+      break;
+    }
+  }
+  return block;
+}
+
+static inline BlockInfo* nextFit(BlockInfo* block, size_t reqSize) {
+  BlockInfo* head = block;
+  BlockInfo* rover = PROLOGUE->rover;
+  BlockInfo* found;
+
+  // Only start at the rover if it is on this list.
+  if (head != NULL && rover != NULL &&
+      sizeClass(SIZE(rover->sizeAndTags)) == sizeClass(SIZE(head->sizeAndTags))) {
+    block = rover;
+  }
+  found = firstFit(block, reqSize);
+  if (found == NULL && block != head) {
+    // Wrap around to the blocks before the rover.
+    for (found = head; found != block; found = NEXT_FREE(found)) {
+      STAT_INC(searchSteps);
+      if (SIZE(found->sizeAndTags) >= reqSize) {
+        break;
+      }
+    }
+    if (found == block) {
+      found = NULL;
+    }
+  }
+  if (found != NULL) {
+    PROLOGUE->rover = NEXT_FREE(found);
+  }
+  return found;
+}
+
+static inline BlockInfo* bestFit(BlockInfo* block, size_t reqSize) {
+  BlockInfo* best = NULL;
+  size_t size;
+
+  for (; block != NULL; block = NEXT_FREE(block)) {
+    STAT_INC(searchSteps);
+    size = SIZE(block->sizeAndTags);
+    if (size >= reqSize && (best == NULL || size < SIZE(best->sizeAndTags))) {
+      best = block;
+      if (size == reqSize) {
+        break;
+      }
+    }
+  }
+  return best;
+}
+
+static inline BlockInfo* goodFit(BlockInfo* block, size_t reqSize) {
+  BlockInfo* best = NULL;
+  size_t size;
+  int tried;
+
+  for (tried = 0; block != NULL && tried < MM_GOOD_FIT_CANDIDATES; tried++) {
+    STAT_INC(searchSteps);
+    size = SIZE(block->sizeAndTags);
+    if (size >= reqSize && (best == NULL || size < SIZE(best->sizeAndTags))) {
+      best = block;
+    }
+    block = NEXT_FREE(block);
+  }
+  return best;
+}
+
+static inline void insertLIFO(BlockInfo* freeBlock, int listIndex) {
+  BlockInfo* oldHead = FREE_LIST_HEAD(listIndex);
+
+  freeBlock->next = TO_LINK(oldHead);
+  if (oldHead != NULL) {
+    oldHead->prev = TO_LINK(freeBlock);
+  }
+  freeBlock->prev = TO_LINK(NULL);
+  FREE_LIST_HEAD(listIndex) = freeBlock;
+}
+
+static inline void insertAddressOrdered(BlockInfo* freeBlock, int listIndex) {
+  BlockInfo* prevFree = NULL;
+  BlockInfo* nextFree = FREE_LIST_HEAD(listIndex);
+
+  while (nextFree != NULL && nextFree < freeBlock) {
+    prevFree = nextFree;
+    nextFree = NEXT_FREE(nextFree);
+  }
+  freeBlock->next = TO_LINK(nextFree);
+  freeBlock->prev = TO_LINK(prevFree);
+  if (nextFree != NULL) {
+    nextFree->prev = TO_LINK(freeBlock);
+  }
+  if (prevFree != NULL) {
+    prevFree->next = TO_LINK(freeBlock);
+  } else {
+    FREE_LIST_HEAD(listIndex) = freeBlock;
+  }
+}
+
+/* Pick a block of at least reqSize bytes from the list starting at
+   'block' with the placement policy, or return NULL. */
+static inline BlockInfo* fitInList(BlockInfo* block, size_t reqSize) {
+#if MM_PLACEMENT == MM_FIRST_FIT
+  return firstFit(block, reqSize);
+#elif MM_PLACEMENT == MM_NEXT_FIT
+  return nextFit(block, reqSize);
+#elif MM_PLACEMENT == MM_BEST_FIT
+  return bestFit(block, reqSize);
+#else
+  return goodFit(block, reqSize);
+#endif
+}
+
+/* Put freeBlock on list listIndex with the insertion policy. */
+static inline void insertInList(BlockInfo* freeBlock, int listIndex) {
+#if MM_INSERTION == MM_ADDRESS_ORDERED
+  insertAddressOrdered(freeBlock, listIndex);
+#else
+  insertLIFO(freeBlock, listIndex);
+#endif
+}
+
+/* Find a free block of the requested size.  Returns NULL if no free
+   block is large enough.
+
+   Large requests take the best fit from the large tree.  For small
+   requests, the placement policy first picks from reqSize's own
+   class, where some blocks may be too small.  Every block in a higher
+   class is large enough, so failing that, it picks from the first
+   non-empty class above it, found by masking the occupancy bitmap.
+   If every larger class is empty, the request falls through to the
+   tree. */
+static void * searchFreeList(size_t reqSize) {   
+  BlockInfo* freeBlock;
+  int listIndex;
+  uint64_t largerClasses;
+
+  STAT_INC(searches);
+  if (reqSize >= LARGE_BLOCK_SIZE) {
+    return searchLargeTree(reqSize);
+  }
+
+  listIndex = sizeClass(reqSize);
+  freeBlock = fitInList(FREE_LIST_HEAD(listIndex), reqSize);
+  if (freeBlock != NULL) {
+    return freeBlock;
+  }
+
+  largerClasses = NON_EMPTY_CLASSES & (~(uint64_t)0 << (listIndex + 1));
+  if (largerClasses != 0) {
+    return fitInList(FREE_LIST_HEAD(__builtin_ctzll(largerClasses)), reqSize);
+  }
+  return searchLargeTree(reqSize);
 }
            
-/* Insert freeBlock at the head of the list.  (LIFO) */
+/* Insert freeBlock into its size class's list, as the insertion policy
+   says, or into the large tree. */
 static void insertFreeBlock(BlockInfo* freeBlock) {
-  BlockInfo* oldHead = FREE_LIST_HEAD;
-  freeBlock->next = oldHead;
-  if (oldHead != NULL) {
-    oldHead->prev = freeBlock;
+  int listIndex;
+
+  TOUCH_BLOCK(freeBlock);
+  STAT_ADD(freeBytes, SIZE(freeBlock->sizeAndTags));
+  STAT_INC(freeBlocks[STAT_CLASS(SIZE(freeBlock->sizeAndTags))]);
+  if (SIZE(freeBlock->sizeAndTags) >= LARGE_BLOCK_SIZE) {
+    insertTreeBlock((TreeBlock*)freeBlock);
+    return;
   }
-  //  freeBlock->prev = NULL;
-  FREE_LIST_HEAD = freeBlock;
+
+  listIndex = sizeClass(SIZE(freeBlock->sizeAndTags));
+  insertInList(freeBlock, listIndex);
+  NON_EMPTY_CLASSES |= (uint64_t)1 << listIndex;
 }      
 
-/* Remove a free block from the free list. */
+/* Remove a free block from its free list or from the large tree. */
 static void removeFreeBlock(BlockInfo* freeBlock) {
   BlockInfo *nextFree, *prevFree;
+
+  UNTOUCH_BLOCK(freeBlock);
+  STAT_SUB(freeBytes, SIZE(freeBlock->sizeAndTags));
+  STAT_SUB(freeBlocks[STAT_CLASS(SIZE(freeBlock->sizeAndTags))], 1);
+  if (SIZE(freeBlock->sizeAndTags) >= LARGE_BLOCK_SIZE) {
+    removeTreeBlock((TreeBlock*)freeBlock);
+    return;
+  }
   
-  nextFree = freeBlock->next;
-  prevFree = freeBlock->prev;
+  nextFree = NEXT_FREE(freeBlock);
+  prevFree = PREV_FREE(freeBlock);
+
+  // Never leave the next fit rover on a block that is not free.
+  if (freeBlock == PROLOGUE->rover) {
+    PROLOGUE->rover = nextFree;
+  }
 
   // If the next block is not null, patch its prev pointer.
   if (nextFree != NULL) {
-    nextFree->prev = prevFree;
+    nextFree->prev = freeBlock->prev;
   }
 
-  // If we're removing the head of the free list, set the head to be
+  // If we're removing the head of its free list, set the head to be
   // the next block, otherwise patch the previous block's next pointer.
-  if (freeBlock == FREE_LIST_HEAD) {
-    FREE_LIST_HEAD = nextFree;
+  // The block's size still selects the list it was inserted on; clear
+  // that list's bit in the occupancy bitmap if this empties it.
+  if (prevFree == NULL) {
+    int listIndex = sizeClass(SIZE(freeBlock->sizeAndTags));
+    FREE_LIST_HEAD(listIndex) = nextFree;
+    if (nextFree == NULL) {
+      NON_EMPTY_CLASSES &= ~((uint64_t)1 << listIndex);
+    }
   } else {
-    prevFree->next = nextFree;
+    prevFree->next = freeBlock->next;
   }
 }
 
-/* Coalesce 'oldBlock' with any preceeding or following free blocks. */
+/* Coalesce the free block 'oldBlock', which is not on a free list yet,
+   with any preceeding or following free blocks, and put the result on
+   its free list.  Filing only the coalesced block spares a large block
+   a trip into the tree and back out, three splays in all. */
 static void coalesceFreeBlock(BlockInfo* oldBlock) {
   BlockInfo *blockCursor;
   BlockInfo *newBlock;
@@ -190,17 +1104,23 @@ static void coalesceFreeBlock(BlockInfo* oldBlock) {
     // prev. block in the free list) is free:
 
     // Get the size of the previous block from its boundary tag.
-    size_t size = SIZE(*((size_t*)UNSCALED_POINTER_SUB(blockCursor, WORD_SIZE)));
+    size_t size = SIZE(*((tag_t*)UNSCALED_POINTER_SUB(blockCursor, TAG_SIZE)));
     // Use this size to find the block info for that block.
     freeBlock = (BlockInfo*)UNSCALED_POINTER_SUB(blockCursor, size);
     // Remove that block from free list.
     removeFreeBlock(freeBlock);
+    STAT_INC(coalesces);
 
     // Count that block's size and update the current block pointer.
     newSize += size;
     blockCursor = freeBlock;
   }
   newBlock = blockCursor;
+  // oldBlock may have been touched, by slabFree say, before it was
+  // merged into the middle of newBlock.
+  if (newBlock != oldBlock) {
+    UNTOUCH_BLOCK(oldBlock);
+  }
 
   // Coalesce with any following free block.
   // Start with the block following this one in memory
@@ -211,29 +1131,25 @@ static void coalesceFreeBlock(BlockInfo* oldBlock) {
     size_t size = SIZE(blockCursor->sizeAndTags);
     // Remove it from the free list.
     removeFreeBlock(blockCursor);
+    STAT_INC(coalesces);
     // Count its size and step to the following block.
     newSize += size;
     blockCursor = (BlockInfo*)UNSCALED_POINTER_ADD(blockCursor, size);
   }
   
-  // If the block actually grew, remove the old entry from the free
-  // list and add the new entry.
+  // If the block actually grew, give it its new size.
   if (newSize != oldSize) {
-    // Remove the original block from the free list
-    removeFreeBlock(oldBlock);
-
     // Save the new size in the block info and in the boundary tag
     // and tag it to show the preceding block is used (otherwise, it
     // would have become part of this one!).
     newBlock->sizeAndTags = newSize | TAG_PRECEDING_USED;
     // The boundary tag of the preceding block is the word immediately
     // preceding block in memory where we left off advancing blockCursor.
-    *(size_t*)UNSCALED_POINTER_SUB(blockCursor, WORD_SIZE) = newSize | TAG_PRECEDING_USED;  
-
-    // Put the new block in the free list.
-    insertFreeBlock(newBlock);
+    *(tag_t*)UNSCALED_POINTER_SUB(blockCursor, TAG_SIZE) = newSize | TAG_PRECEDING_USED;  
   }
-  return;
+
+  // Put the new block in the free list.
+  insertFreeBlock(newBlock);
 }
 
 /* Get more heap space of size at least reqSize. */
@@ -243,21 +1159,37 @@ static void requestMoreSpace(size_t reqSize) {
   BlockInfo *newBlock;
   size_t totalSize = numPages * pagesize;
   size_t prevLastWordMask;
+  size_t precedingSize = 0;
+  char* staleStart;
+  char* staleEnd;
+
+  // The compact layout's 32-bit tags and links cannot reach past 4 GB,
+  // however large memlib lets the heap grow.
+  if (COMPACT_LAYOUT &&
+      (size_t)(curArena->end - heapBase) + totalSize > (size_t)UINT32_MAX) {
+    printf("ERROR: heap outgrew the compact layout in requestMoreSpace\n");
+    exit(0);
+  }
 
-  void* mem_sbrk_result = mem_sbrk(totalSize);
+  void* mem_sbrk_result = mem_arena_sbrk(ARENA_INDEX, totalSize);
   if ((size_t)mem_sbrk_result == -1) {
     printf("ERROR: mem_sbrk failed in requestMoreSpace\n");
     exit(0);
   }
-  newBlock = (BlockInfo*)UNSCALED_POINTER_SUB(mem_sbrk_result, WORD_SIZE);
+  STAT_INC(sbrkCalls);
+  ATOMIC_STORE(curArena->end, (char*)mem_sbrk_result + totalSize);
+  newBlock = (BlockInfo*)UNSCALED_POINTER_SUB(mem_sbrk_result, TAG_SIZE);
 
   /* initialize header, inherit TAG_PRECEDING_USED status from the
      previously useless last word however, reset the fake TAG_USED
      bit */
   prevLastWordMask = newBlock->sizeAndTags & TAG_PRECEDING_USED;
+  if (!prevLastWordMask) {
+    precedingSize = SIZE(*(tag_t*)UNSCALED_POINTER_SUB(newBlock, TAG_SIZE));
+  }
   newBlock->sizeAndTags = totalSize | prevLastWordMask;
   // Initialize boundary tag.
-  ((BlockInfo*)UNSCALED_POINTER_ADD(newBlock, totalSize - WORD_SIZE))->sizeAndTags = 
+  ((BlockInfo*)UNSCALED_POINTER_ADD(newBlock, totalSize - TAG_SIZE))->sizeAndTags = 
     totalSize | prevLastWordMask;
 
   /* initialize "new" useless last word
@@ -266,108 +1198,132 @@ static void requestMoreSpace(size_t reqSize) {
      This trick lets us do the "normal" check even at the end of
      the heap and avoid a special check to see if the following
      block is the end of the heap... */
-  *((size_t*)UNSCALED_POINTER_ADD(newBlock, totalSize)) = TAG_USED;
+  *((tag_t*)UNSCALED_POINTER_ADD(newBlock, totalSize)) = TAG_USED;
 
-  // Add the new block to the free list and immediately coalesce newly
-  // allocated memory space
-  insertFreeBlock(newBlock);
+  // Coalesce the newly allocated memory space and add it to the free
+  // list
   coalesceFreeBlock(newBlock);
+
+  if (!mem_arena_zeroed(ARENA_INDEX)) {
+    curArena->zeroStart = curArena->end;
+  } else if (precedingSize > 0) {
+    // The new space is zero, but coalescing left the old boundary tag,
+    // heap-footer and the new block's links in the middle of the free
+    // block.  Clear them, up to the links of the coalesced block.
+    staleStart = (char*)UNSCALED_POINTER_SUB(newBlock, TAG_SIZE);
+    staleEnd = (char*)UNSCALED_POINTER_ADD(newBlock, sizeof(TreeBlock));
+    if (staleStart < (char*)newBlock - precedingSize + sizeof(TreeBlock)) {
+      staleStart = (char*)newBlock - precedingSize + sizeof(TreeBlock);
+    }
+    if (staleStart < staleEnd) {
+      memset(staleStart, 0, staleEnd - staleStart);
+    }
+  }
 }
 
+/* The inverse of requestMoreSpace: if the block at the end of the
+   heap is free and at least TRIM_THRESHOLD bytes, shrink it to about
+   TRIM_PAD bytes and give the rest of the heap back with mem_trim. */
+static void trimHeap() {
+  tag_t* heapFooter = (tag_t*)UNSCALED_POINTER_SUB(curArena->end, TAG_SIZE);
+  BlockInfo* lastBlock;
+  size_t lastSize;
+  size_t pagesize = mem_pagesize();
+  size_t trimSize;
 
-/* Print the heap by iterating through it as an implicit free list. */
-static void examine_heap() {
-  BlockInfo *block;
+  // The heap-footer's TAG_PRECEDING_USED tells whether the last block
+  // is free, and if it is, its boundary tag sits right before the
+  // heap-footer.
+  if (*heapFooter & TAG_PRECEDING_USED) {
+    return;
+  }
+  lastSize = SIZE(*(tag_t*)UNSCALED_POINTER_SUB(heapFooter, TAG_SIZE));
+  if (lastSize < TRIM_THRESHOLD) {
+    return;
+  }
+  lastBlock = (BlockInfo*)UNSCALED_POINTER_SUB(heapFooter, lastSize);
+  trimSize = (lastSize - TRIM_PAD) / pagesize * pagesize;
+  // With huge pages the heap may not even have one page to spare.
+  if (trimSize == 0) {
+    return;
+  }
 
-  /* print to stderr so output isn't buffered and not output if we crash */
-  fprintf(stderr, "FREE_LIST_HEAD: %p\n", (void *)FREE_LIST_HEAD);
+  // Re-file the block under its new size, then move the heap-footer
+  // down to its new end.
+  removeFreeBlock(lastBlock);
+  lastSize -= trimSize;
+  lastBlock->sizeAndTags = lastSize | (lastBlock->sizeAndTags & TAG_PRECEDING_USED);
+  *(tag_t*)UNSCALED_POINTER_ADD(lastBlock, lastSize - TAG_SIZE) = lastBlock->sizeAndTags;
+  *(tag_t*)UNSCALED_POINTER_ADD(lastBlock, lastSize) = TAG_USED;
+  insertFreeBlock(lastBlock);
+
+  if ((ssize_t)mem_arena_trim(ARENA_INDEX, trimSize) == -1) {
+    printf("ERROR: mem_trim failed in trimHeap\n");
+    exit(0);
+  }
+  ATOMIC_STORE(curArena->end, curArena->end - trimSize);
+  if (curArena->zeroStart > curArena->end) {
+    curArena->zeroStart = curArena->end;
+  }
+}
 
-  for (block = (BlockInfo *)UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE); /* first block on hea\
-									       p */
-       SIZE(block->sizeAndTags) != 0 && (void*)block < (void*)mem_heap_hi();
-       block = (BlockInfo *)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags))) {
 
-    /* print out common block attributes */
-    fprintf(stderr, "%p: %ld %ld %ld\t",
-            (void *)block,
-            SIZE(block->sizeAndTags),
-            block->sizeAndTags & TAG_PRECEDING_USED,
-            block->sizeAndTags & TAG_USED);
+/* The used block 'block' may be written all over, so its bytes no
+   longer count as zero. */
+static void markWritten(BlockInfo* block) {
+  char* blockEnd = (char*)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags));
 
-    /* and allocated/free specific data */
-    if (block->sizeAndTags & TAG_USED) {
-      fprintf(stderr, "ALLOCATED\n");
-    } else {
-      fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
-              (void *)block->next,
-              (void *)block->prev);
-    }
+  if (blockEnd > curArena->zeroStart) {
+    curArena->zeroStart = blockEnd;
   }
-  fprintf(stderr, "END OF HEAP\n\n");
 }
 
-/* Initialize the allocator. */
-int mm_init () {
-  // Head of the free list.
-  BlockInfo *firstFreeBlock;
-
-  // Initial heap size: WORD_SIZE byte heap-header (stores pointer to head
-  // of free list), MIN_BLOCK_SIZE bytes of space, WORD_SIZE byte heap-footer.
-  size_t initSize = WORD_SIZE+MIN_BLOCK_SIZE+WORD_SIZE;
-  size_t totalSize;
+/* Mark the free block 'block', already removed from the free lists,
+   as used.  If at least MIN_BLOCK_SIZE bytes are left over past
+   reqSize, split them off into a new free block. */
+static void placeBlock(BlockInfo* ptrFreeBlock, size_t reqSize) {
+  size_t blockSize;
+  size_t precedingBlockUseTag;
 
-  void* mem_sbrk_result = mem_sbrk(initSize);
-  //  printf("mem_sbrk returned %p\n", mem_sbrk_result);
-  if ((ssize_t)mem_sbrk_result == -1) {
-    printf("ERROR: mem_sbrk failed in mm_init, returning %p\n", 
-           mem_sbrk_result);
-    exit(1);
-  }
+  TOUCH_BLOCK(ptrFreeBlock);
+  blockSize = SIZE(ptrFreeBlock->sizeAndTags); // get block size
 
-  firstFreeBlock = (BlockInfo*)UNSCALED_POINTER_ADD(mem_heap_lo(), WORD_SIZE);
+  precedingBlockUseTag = ptrFreeBlock->sizeAndTags & TAG_PRECEDING_USED; // Store the preceding block's used tag
 
-  // Total usable size is full size minus heap-header and heap-footer words
-  // NOTE: These are different than the "header" and "footer" of a block!
-  // The heap-header is a pointer to the first free block in the free list.
-  // The heap-footer is used to keep the data structures consistent (see
-  // requestMoreSpace() for more info, but you should be able to ignore it).
-  totalSize = initSize - WORD_SIZE - WORD_SIZE;
+  size_t MIN_BLOCK_DIFFERENCE = blockSize - reqSize;
 
-  // The heap starts with one free block, which we initialize now.
-  firstFreeBlock->sizeAndTags = totalSize | TAG_PRECEDING_USED;
-  firstFreeBlock->next = NULL;
-  firstFreeBlock->prev = NULL;
-  // boundary tag
-  *((size_t*)UNSCALED_POINTER_ADD(firstFreeBlock, totalSize - WORD_SIZE)) = totalSize | TAG_PRECEDING_USED;
-  
-  // Tag "useless" word at end of heap as used.
-  // This is the is the heap-footer.
-  *((size_t*)UNSCALED_POINTER_SUB(mem_heap_hi(), WORD_SIZE - 1)) = TAG_USED;
+  if (MIN_BLOCK_SIZE > MIN_BLOCK_DIFFERENCE) { // split block if MIN_BLOCK_SIZE > (blockSize - reqSize)
 
-  // set the head of the free list to this new free block.
-  FREE_LIST_HEAD = firstFreeBlock;
-  return 0;
-}
+    BlockInfo* NextBlock = (BlockInfo*) UNSCALED_POINTER_ADD(ptrFreeBlock, blockSize); // get pointer to next block
 
+    ATOMIC_OR(NextBlock->sizeAndTags, TAG_PRECEDING_USED); // Set the next block's previous used tag
+    ptrFreeBlock->sizeAndTags |= TAG_USED; // Set the used tag of the block
 
-// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+  } else {
+    STAT_INC(splits);
+    ptrFreeBlock->sizeAndTags = precedingBlockUseTag | reqSize; // Set the block's size and tags
+    ptrFreeBlock->sizeAndTags |= TAG_USED; // Set the used tag of the block
 
+    
+    *((tag_t*) UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize)) = TAG_PRECEDING_USED | MIN_BLOCK_DIFFERENCE; // set preceiding used tag of free block
 
-/* Allocate a block of size size and return a pointer to it. */
-void* mm_malloc (size_t size) {
-  size_t reqSize;
-  BlockInfo * ptrFreeBlock = NULL;
-  size_t blockSize;
-  size_t precedingBlockUseTag;
+    
+    *((tag_t*) UNSCALED_POINTER_ADD(ptrFreeBlock, blockSize - TAG_SIZE)) = TAG_PRECEDING_USED | MIN_BLOCK_DIFFERENCE; // set preceding used tag within boundary
 
-  // Zero-size requests get NULL.
-  if (size == 0) {
-    return NULL;
+    
+    insertFreeBlock((BlockInfo*) UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize)); // insert free block
   }
+  markWritten(ptrFreeBlock);
+}
+
+/* Size of the block needed for a payload of 'size' bytes: one header
+   word more, rounded up for alignment, and at least MIN_BLOCK_SIZE. */
+static size_t requestSize(size_t size) {
+  size_t reqSize;
 
   // Add one word for the initial size header.
   // Note that we don't need to boundary tag when the block is used!
-  size += WORD_SIZE;
+  size += TAG_SIZE;
   if (size <= MIN_BLOCK_SIZE) {
     // Make sure we allocate enough space for a blockInfo in case we
     // free this block (when we free this block, we'll need to use the
@@ -377,73 +1333,2217 @@ void* mm_malloc (size_t size) {
     // Round up for correct alignment
     reqSize = ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
   }
+  return reqSize;
+}
 
-  // Implement mm_malloc.  You can change or remove any of the above
-  // code.  It is included as a suggestion of where to start.
-  // You will want to replace this return statement...
+static BlockInfo* quickGet(size_t reqSize);
+static void flushQuickLists();
+#if PRECARVE
+static void preCarve(BlockInfo* remainder);
+#endif
+
+/* Allocate a block of reqSize bytes (a multiple of ALIGNMENT, header
+   included), from a quick list if one has a block of exactly that
+   size, otherwise from the free lists, flushing the quick lists and
+   then growing the heap if no free block is large enough.  After
+   growing the heap, pre-carve blocks of the hottest size from what is
+   left of the new space. */
+static BlockInfo* allocateBlock(size_t reqSize) {
+  BlockInfo * ptrFreeBlock;
+#if PRECARVE
+  int grewHeap = 0;
+#endif
+
+  if (deferCoalescing && (ptrFreeBlock = quickGet(reqSize)) != NULL) {
+    return ptrFreeBlock;
+  }
 
   ptrFreeBlock = searchFreeList(reqSize); // get free block
+  if (ptrFreeBlock == NULL && PROLOGUE->quickCount > 0) {
+    flushQuickLists();
+    ptrFreeBlock = searchFreeList(reqSize);
+  }
 
   if(ptrFreeBlock == NULL){
 
     requestMoreSpace(reqSize); // if not enough room, get more heap space
     ptrFreeBlock = searchFreeList(reqSize); // look for free block
-
+#if PRECARVE
+    grewHeap = 1;
+#endif
   }
 
   removeFreeBlock(ptrFreeBlock); // Remove free block
+  placeBlock(ptrFreeBlock, reqSize);
+#if PRECARVE
+  if (grewHeap) {
+    preCarve((BlockInfo*)UNSCALED_POINTER_ADD(ptrFreeBlock, SIZE(ptrFreeBlock->sizeAndTags)));
+  }
+#endif
+  return ptrFreeBlock;
+}
 
-  blockSize = SIZE(ptrFreeBlock->sizeAndTags); // get block size
+/* Allocate n blocks of reqSize bytes each and store their payloads in
+   out[].  Rather than search and split once per block, take as many
+   blocks as fit from each free block found, writing their headers in
+   one pass and splitting only the last: first from a free block that
+   holds them all, else from any that holds at least one, and only
+   then from new heap space. */
+static void allocateBlocks(size_t reqSize, size_t n, void** out) {
+  BlockInfo* block;
+  BlockInfo* last;
+  size_t blockSize;
+  size_t want;
+  size_t carved;
+  size_t count = 0;
+  size_t i;
 
-  precedingBlockUseTag = ptrFreeBlock->sizeAndTags & TAG_PRECEDING_USED; // Store the preceding block's used tag
+  while (deferCoalescing && count < n && (block = quickGet(reqSize)) != NULL) {
+    out[count++] = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+  }
 
-  size_t MIN_BLOCK_DIFFERENCE = blockSize - reqSize;
+  while (count < n) {
+    want = n - count;
+    if (want > MAX_BLOCK_SIZE / 2 / reqSize) {
+      want = MAX_BLOCK_SIZE / 2 / reqSize;
+    }
+    block = searchFreeList(want * reqSize);
+    if (block == NULL && want > 1) {
+      block = searchFreeList(reqSize);
+    }
+    if (block == NULL && PROLOGUE->quickCount > 0) {
+      flushQuickLists();
+      block = searchFreeList(reqSize);
+    }
+    if (block == NULL) {
+      requestMoreSpace(want * reqSize);
+      block = searchFreeList(want * reqSize);
+    }
+    removeFreeBlock(block);
 
-  if (MIN_BLOCK_SIZE > MIN_BLOCK_DIFFERENCE) { // split block if MIN_BLOCK_SIZE > (blockSize - reqSize)
+    blockSize = SIZE(block->sizeAndTags);
+    carved = blockSize / reqSize;
+    if (carved > want) {
+      carved = want;
+    }
+    // Every block but the last is exactly reqSize; the last gets the
+    // rest, which placeBlock splits off as usual.
+    for (i = 0; i + 1 < carved; i++) {
+      block->sizeAndTags = reqSize | TAG_USED | (block->sizeAndTags & TAG_PRECEDING_USED);
+      TOUCH_BLOCK(block);
+      STAT_INC(splits);
+      out[count++] = UNSCALED_POINTER_ADD(block, TAG_SIZE);
+      block = (BlockInfo*)UNSCALED_POINTER_ADD(block, reqSize);
+      block->sizeAndTags = TAG_PRECEDING_USED;
+    }
+    last = block;
+    last->sizeAndTags |= blockSize - i * reqSize;
+    placeBlock(last, reqSize);
+    out[count++] = UNSCALED_POINTER_ADD(last, TAG_SIZE);
+  }
+}
 
-    BlockInfo* NextBlock = (BlockInfo*) UNSCALED_POINTER_ADD(ptrFreeBlock, blockSize); // get pointer to next block
+/* Bytes from the start of 'block' to the header of the first payload
+   at or after its own that is aligned to 'alignment'.  The gap is
+   either zero or large enough to be a free block of its own. */
+static size_t alignedLeadSize(BlockInfo* block, size_t alignment) {
+  uintptr_t payload = (uintptr_t)UNSCALED_POINTER_ADD(block, TAG_SIZE);
+  uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
 
-    NextBlock->sizeAndTags |= TAG_PRECEDING_USED; // Set the next block's previous used tag
-    ptrFreeBlock->sizeAndTags |= TAG_USED; // Set the used tag of the block
+  while (aligned != payload && aligned - payload < MIN_BLOCK_SIZE) {
+    aligned += alignment;
+  }
+  return aligned - payload;
+}
 
-  } else {
-    
-    ptrFreeBlock->sizeAndTags = precedingBlockUseTag | reqSize; // Set the block's size and tags
-    ptrFreeBlock->sizeAndTags |= TAG_USED; // Set the used tag of the block
+/* Allocate a block of reqSize bytes whose payload is aligned to
+   'alignment', a power of two and a multiple of ALIGNMENT.  The
+   misaligned leading part of the free block it is carved from becomes
+   a free block of its own. */
+static BlockInfo* allocateAlignedBlock(size_t reqSize, size_t alignment) {
+  BlockInfo* block;
+  BlockInfo* alignedBlock;
+  size_t blockSize;
+  size_t leadSize;
+  size_t paddedSize;
+
+  // The best fit for reqSize may happen to have an aligned payload, or
+  // room for one.  Failing that, any block of paddedSize has room for
+  // an aligned payload after a leading free block.
+  block = searchFreeList(reqSize);
+  if (block == NULL ||
+      alignedLeadSize(block, alignment) + reqSize > SIZE(block->sizeAndTags)) {
+    paddedSize = reqSize + alignment + MIN_BLOCK_SIZE;
+    block = searchFreeList(paddedSize);
+    if (block == NULL && PROLOGUE->quickCount > 0) {
+      flushQuickLists();
+      block = searchFreeList(paddedSize);
+    }
+    if (block == NULL) {
+      requestMoreSpace(paddedSize);
+      block = searchFreeList(paddedSize);
+    }
+  }
+  removeFreeBlock(block);
+
+  leadSize = alignedLeadSize(block, alignment);
+  if (leadSize > 0) {
+    // Split off the leading part.  The block was free, so the block
+    // preceding it is in use and the leading part cannot coalesce.
+    blockSize = SIZE(block->sizeAndTags);
+    alignedBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, leadSize);
+    block->sizeAndTags = leadSize | (block->sizeAndTags & TAG_PRECEDING_USED);
+    *((tag_t*)UNSCALED_POINTER_ADD(block, leadSize - TAG_SIZE)) = block->sizeAndTags;
+    insertFreeBlock(block);
+    STAT_INC(splits);
+    alignedBlock->sizeAndTags = blockSize - leadSize;
+    block = alignedBlock;
+  }
+  placeBlock(block, reqSize);
+  return block;
+}
 
-    
-    *((size_t*) UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize)) = TAG_PRECEDING_USED | MIN_BLOCK_DIFFERENCE; // set preceiding used tag of free block
+/* Free an allocated block: mark it free, put it on a free list and
+   coalesce it with its neighbors, then trim the heap if that left a
+   large free block at its end. */
+static void freeBlock(BlockInfo* blockInfo) {
+  size_t payloadSize = SIZE(blockInfo->sizeAndTags);
+  BlockInfo* followingBlock = (BlockInfo*) UNSCALED_POINTER_ADD(blockInfo, payloadSize);
 
-    
-    *((size_t*) UNSCALED_POINTER_ADD(ptrFreeBlock, blockSize - WORD_SIZE)) = TAG_PRECEDING_USED | MIN_BLOCK_DIFFERENCE; // set preceding used tag within boundary
+  // Mark the block free and give it a boundary tag so the block
+  // following it can find its start when coalescing.
+  blockInfo->sizeAndTags &= ~(TAG_USED | TAG_REALLOCED);
+  *((tag_t*) UNSCALED_POINTER_ADD(blockInfo, payloadSize - TAG_SIZE)) = blockInfo->sizeAndTags;
 
-    
-    insertFreeBlock((BlockInfo*) UNSCALED_POINTER_ADD(ptrFreeBlock, reqSize)); // insert free block
+  // Tell the following block its predecessor is no longer in use.
+  ATOMIC_AND(followingBlock->sizeAndTags, ~(tag_t)TAG_PRECEDING_USED);
+
+  coalesceFreeBlock(blockInfo);
+  trimHeap();
+}
+
+/* Pop a block of exactly reqSize bytes from its quick list, or return
+   NULL if there is none. */
+static BlockInfo* quickGet(size_t reqSize) {
+  BlockInfo* block;
+  size_t bin;
+
+  if (reqSize >= QUICK_MAX_SIZE || PROLOGUE->nonEmptyQuickLists == 0) {
+    return NULL;
+  }
+  bin = QUICK_BIN(reqSize);
+  block = (BlockInfo*)FROM_LINK(PROLOGUE->quickLists[bin]);
+  if (block != NULL) {
+    PROLOGUE->quickLists[bin] = block->next;
+    if (block->next == TO_LINK(NULL)) {
+      PROLOGUE->nonEmptyQuickLists &= ~((uint64_t)1 << bin);
+    }
+    PROLOGUE->quickCount--;
+  }
+  return block;
+}
+
+/* Push the used block 'block' onto its quick list instead of freeing
+   it.  Returns 1 if it was pushed, and 0 if it must be freed now. */
+static int quickPut(BlockInfo* block) {
+  size_t blockSize = SIZE(block->sizeAndTags);
+  size_t bin;
+
+  if (blockSize >= QUICK_MAX_SIZE) {
+    return 0;
+  }
+  if (PROLOGUE->quickLists == NULL) {
+    // The table cannot come from a quick list: they are all empty.
+    PROLOGUE->quickLists = UNSCALED_POINTER_ADD(allocateBlock(requestSize(NUM_QUICK_BINS * sizeof(link_t))), TAG_SIZE);
+    memset(PROLOGUE->quickLists, 0, NUM_QUICK_BINS * sizeof(link_t));
+  }
+  bin = QUICK_BIN(blockSize);
+  block->sizeAndTags &= ~(tag_t)TAG_REALLOCED;
+  block->next = PROLOGUE->quickLists[bin];
+  PROLOGUE->quickLists[bin] = TO_LINK(block);
+  PROLOGUE->nonEmptyQuickLists |= (uint64_t)1 << bin;
+  if (++PROLOGUE->quickCount > QUICK_FLUSH_THRESHOLD) {
+    flushQuickLists();
+  }
+  return 1;
+}
+
+/* Free and coalesce every block on the quick lists. */
+static void flushQuickLists() {
+  BlockInfo* block;
+  int bin;
+
+  while (PROLOGUE->nonEmptyQuickLists != 0) {
+    bin = __builtin_ctzll(PROLOGUE->nonEmptyQuickLists);
+    PROLOGUE->nonEmptyQuickLists &= ~((uint64_t)1 << bin);
+    block = (BlockInfo*)FROM_LINK(PROLOGUE->quickLists[bin]);
+    PROLOGUE->quickLists[bin] = TO_LINK(NULL);
+    while (block != NULL) {
+      BlockInfo* next = NEXT_FREE(block);
+      freeBlock(block);
+      block = next;
+    }
+  }
+  PROLOGUE->quickCount = 0;
+}
+
+#if PRECARVE
+/* Give every block in the pool of 'entry' back to the free lists. */
+static void releasePool(HotSize* entry) {
+  BlockInfo* block;
+
+  while ((block = (BlockInfo*)FROM_LINK(entry->pool)) != NULL) {
+    entry->pool = block->next;
+    freeBlock(block);
+  }
+}
+
+/* Count a request for a block of reqSize bytes in the hot size table,
+   and pop a pre-carved block of that size if its pool has one. */
+static BlockInfo* takePrecarved(size_t reqSize) {
+  HotSize* entry = NULL;
+  HotSize* coldest = &PROLOGUE->hotSizes[0];
+  BlockInfo* block;
+  int i;
+
+  PROLOGUE->precarveRequests++;
+  for (i = 0; i < NUM_HOT_SIZES; i++) {
+    if (PROLOGUE->hotSizes[i].size == reqSize) {
+      entry = &PROLOGUE->hotSizes[i];
+      break;
+    }
+    if (PROLOGUE->hotSizes[i].count < coldest->count) {
+      coldest = &PROLOGUE->hotSizes[i];
+    }
+  }
+  if (entry == NULL) {
+    // Space-saving: the new size replaces the coldest one.
+    releasePool(coldest);
+    coldest->size = reqSize;
+    coldest->count++;
+    return NULL;
+  }
+
+  entry->count++;
+  block = (BlockInfo*)FROM_LINK(entry->pool);
+  if (block != NULL) {
+    entry->pool = block->next;
+    PROLOGUE->precarveHits++;
+  }
+  return block;
+}
+
+/* Carve up to PRECARVE_COUNT blocks of the hottest size from the start
+   of 'remainder' into its pool, if that size is hot and its pool is
+   empty.  'remainder' must be free and is left with at least
+   MIN_BLOCK_SIZE bytes. */
+static void preCarve(BlockInfo* remainder) {
+  HotSize* hottest = &PROLOGUE->hotSizes[0];
+  size_t size;
+  int carved;
+  int i;
+
+  for (i = 1; i < NUM_HOT_SIZES; i++) {
+    if (PROLOGUE->hotSizes[i].count > hottest->count) {
+      hottest = &PROLOGUE->hotSizes[i];
+    }
+  }
+  size = hottest->size;
+  if (hottest->count < PRECARVE_MIN_COUNT || size > PRECARVE_MAX_SIZE ||
+      hottest->pool != TO_LINK(NULL)) {
+    return;
+  }
+
+  for (carved = 0; carved < PRECARVE_COUNT &&
+         (remainder->sizeAndTags & TAG_USED) == 0 &&
+         SIZE(remainder->sizeAndTags) >= size + MIN_BLOCK_SIZE; carved++) {
+    removeFreeBlock(remainder);
+    placeBlock(remainder, size);
+    remainder->next = hottest->pool;
+    hottest->pool = TO_LINK(remainder);
+    remainder = (BlockInfo*)UNSCALED_POINTER_ADD(remainder, size);
+  }
+}
+#endif
+
+
+/* Shrink the used block 'block' to reqSize bytes.  If at least
+   MIN_BLOCK_SIZE bytes are left over, they become a free block, which
+   coalesces with the block following it if that one is free. */
+static void shrinkBlock(BlockInfo* block, size_t reqSize) {
+  size_t blockSize = SIZE(block->sizeAndTags);
+  BlockInfo* tail;
+
+  TOUCH_BLOCK(block);
+  if (blockSize - reqSize < MIN_BLOCK_SIZE) {
+    return;
+  }
+  STAT_INC(splits);
+  block->sizeAndTags = reqSize | (block->sizeAndTags & (ALIGNMENT - 1));
+  tail = (BlockInfo*)UNSCALED_POINTER_ADD(block, reqSize);
+  tail->sizeAndTags = (blockSize - reqSize) | TAG_USED | TAG_PRECEDING_USED;
+  freeBlock(tail);
+}
+
+/* Is the used block 'block' the last one in the heap, not counting a
+   free block after it?  If so, new heap space lands right after it
+   (coalescing with the free block in between, if any). */
+static int isLastBlock(BlockInfo* block) {
+  BlockInfo* followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags));
+
+  if ((followingBlock->sizeAndTags & TAG_USED) == 0) {
+    followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(followingBlock, SIZE(followingBlock->sizeAndTags));
+  }
+  // The heap-footer is the only "block" of size 0.
+  return SIZE(followingBlock->sizeAndTags) == 0;
+}
+
+/* Try to grow the used block 'block' to at least reqSize bytes without
+   moving it, by absorbing the free block following it and, if
+   mayGrowHeap is set and 'block' is the last block in the heap, by
+   growing the heap.  Returns 1 if the block now has reqSize bytes, and
+   0 (leaving it unchanged) if not. */
+static int growBlockInPlace(BlockInfo* block, size_t reqSize, int mayGrowHeap) {
+  size_t blockSize = SIZE(block->sizeAndTags);
+  BlockInfo* followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, blockSize);
+  size_t available = blockSize;
+
+  if ((followingBlock->sizeAndTags & TAG_USED) == 0) {
+    available += SIZE(followingBlock->sizeAndTags);
+  }
+
+  if (available < reqSize) {
+    if (!mayGrowHeap || !isLastBlock(block)) {
+      return 0;
+    }
+    requestMoreSpace(reqSize - available);
+    followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, blockSize);
+    available = blockSize + SIZE(followingBlock->sizeAndTags);
+  }
+
+  if (available > blockSize) {
+    // Absorb the following free block.
+    removeFreeBlock(followingBlock);
+    block->sizeAndTags = available | (block->sizeAndTags & (ALIGNMENT - 1));
+    followingBlock = (BlockInfo*)UNSCALED_POINTER_ADD(block, available);
+    ATOMIC_OR(followingBlock->sizeAndTags, TAG_PRECEDING_USED);
+  }
+  shrinkBlock(block, reqSize);
+  markWritten(block);
+  return 1;
+}
+
+
+/******** SLAB RUNS ***************************************************/
+
+
+/* Is ptr inside a slab run? */
+static int inSlabRun(void* ptr) {
+  size_t index = RUN_MAP_INDEX(ptr);
+  // Read the size before the map: a new, larger map is published
+  // before its size (see markSlabRun).
+  size_t words = ATOMIC_LOAD(PROLOGUE->runMapWords);
+  uint64_t* runMap = ATOMIC_LOAD(PROLOGUE->runMap);
+
+  return index / 64 < words && ((ATOMIC_LOAD(runMap[index / 64]) >> (index % 64)) & 1);
+}
+
+/* Set or clear the run map bit for run, growing the run map first if
+   it does not reach that far.  With MM_THREAD_SAFE, a thread cache
+   may be reading the old map without the lock, so an outgrown map is
+   never freed; the map doubles each time, so that wastes less space
+   than the live map takes. */
+static void markSlabRun(SlabRun* run, int isRun) {
+  size_t index = RUN_MAP_INDEX(run);
+  size_t oldWords = PROLOGUE->runMapWords;
+  size_t newWords;
+  uint64_t* newMap;
+
+  if (index / 64 >= oldWords) {
+    newWords = 2 * oldWords;
+    if (newWords <= index / 64) {
+      newWords = index / 64 + 1;
+    }
+    newMap = UNSCALED_POINTER_ADD(allocateBlock(requestSize(newWords * sizeof(uint64_t))), TAG_SIZE);
+    memset(newMap, 0, newWords * sizeof(uint64_t));
+    if (oldWords > 0) {
+      memcpy(newMap, PROLOGUE->runMap, oldWords * sizeof(uint64_t));
+      if (!MM_THREAD_SAFE) {
+        freeBlock((BlockInfo*)UNSCALED_POINTER_SUB(PROLOGUE->runMap, TAG_SIZE));
+      }
+    }
+    ATOMIC_STORE(PROLOGUE->runMap, newMap);
+    ATOMIC_STORE(PROLOGUE->runMapWords, newWords);
+  }
+
+  if (isRun) {
+    ATOMIC_STORE(PROLOGUE->runMap[index / 64],
+                 PROLOGUE->runMap[index / 64] | ((uint64_t)1 << (index % 64)));
+  } else {
+    ATOMIC_STORE(PROLOGUE->runMap[index / 64],
+                 PROLOGUE->runMap[index / 64] & ~((uint64_t)1 << (index % 64)));
+  }
+}
+
+/* Put run at the head of its class's list of runs with free objects. */
+static void pushSlabRun(SlabRun* run, int slabClass) {
+  SlabRun* oldHead = SLAB_RUN_HEAD(slabClass);
+  run->nextRun = TO_LINK(oldHead);
+  run->prevRun = TO_LINK(NULL);
+  if (oldHead != NULL) {
+    oldHead->prevRun = TO_LINK(run);
+  }
+  SLAB_RUN_HEAD(slabClass) = run;
+}
+
+/* Take run off its class's list of runs with free objects. */
+static void removeSlabRun(SlabRun* run, int slabClass) {
+  if (NEXT_RUN(run) != NULL) {
+    NEXT_RUN(run)->prevRun = run->prevRun;
+  }
+  if (PREV_RUN(run) != NULL) {
+    PREV_RUN(run)->nextRun = run->nextRun;
+  } else {
+    SLAB_RUN_HEAD(slabClass) = NEXT_RUN(run);
+  }
+}
+
+/* Carve a new, empty run for a slab class out of the heap. */
+static SlabRun* newSlabRun(int slabClass) {
+  BlockInfo* block = allocateAlignedBlock(RUN_SIZE, RUN_SIZE);
+  SlabRun* run = (SlabRun*)UNSCALED_POINTER_ADD(block, TAG_SIZE);
+  int word;
+
+  // Objects fill the page after the SlabRun fields, up to the
+  // following block's header.
+  run->objectSize = (slabClass + 1) * ALIGNMENT;
+  run->numObjects = (RUN_SIZE - TAG_SIZE - sizeof(SlabRun)) / run->objectSize;
+  run->numFree = run->numObjects;
+  for (word = 0; word < FREE_MAP_WORDS; word++) {
+    if ((word + 1) * 64 <= run->numObjects) {
+      run->freeMap[word] = ~(uint64_t)0;
+    } else if (word * 64 < run->numObjects) {
+      run->freeMap[word] = ((uint64_t)1 << (run->numObjects - word * 64)) - 1;
+    } else {
+      run->freeMap[word] = 0;
+    }
+  }
+
+  markSlabRun(run, 1);
+  pushSlabRun(run, slabClass);
+  return run;
+}
+
+/* Allocate an object of at most SLAB_MAX_SIZE bytes from a run. */
+static void* slabAlloc(size_t size) {
+  int slabClass = SLAB_CLASS(size);
+  SlabRun* run = SLAB_RUN_HEAD(slabClass);
+  size_t slot;
+  int word;
+
+  if (run == NULL) {
+    run = newSlabRun(slabClass);
+  }
+
+  // Take the lowest free object.
+  for (word = 0; run->freeMap[word] == 0; word++) {
+  }
+  slot = word * 64 + __builtin_ctzll(run->freeMap[word]);
+  run->freeMap[word] &= run->freeMap[word] - 1;
+  TOUCH_BLOCK(UNSCALED_POINTER_SUB(run, TAG_SIZE));
+
+  // Full runs are not kept on the list.
+  if (--run->numFree == 0) {
+    removeSlabRun(run, slabClass);
+  }
+  STAT_ALLOCATED(run->objectSize);
+  return UNSCALED_POINTER_ADD(run, sizeof(SlabRun) + slot * run->objectSize);
+}
+
+/* Free an object allocated by slabAlloc.  The class comes from the
+   run, never from the size the caller asked for: mm_realloc can
+   shrink an object in place, leaving it in a run of a larger class. */
+static void slabFree(void* ptr) {
+  SlabRun* run = (SlabRun*)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1));
+  int slabClass = SLAB_CLASS(run->objectSize);
+  size_t offset = (char*)ptr - (char*)run - sizeof(SlabRun);
+  size_t slot = offset / run->objectSize;
+
+#if MM_CHECK
+  if (offset % run->objectSize != 0 || slot >= run->numObjects ||
+      ((run->freeMap[slot / 64] >> (slot % 64)) & 1)) {
+    printf("ERROR: %p is not a used slab object\n", ptr);
+    exit(1);
+  }
+#endif
+
+  run->freeMap[slot / 64] |= (uint64_t)1 << (slot % 64);
+  TOUCH_BLOCK(UNSCALED_POINTER_SUB(run, TAG_SIZE));
+  STAT_FREED(run->objectSize);
+  if (run->numFree++ == 0) {
+    // The run was full, so it goes back on the list.
+    pushSlabRun(run, slabClass);
+  }
+
+  // Give an empty run back to the heap, unless it is the only run of
+  // its class with free objects (so alternating malloc and free of one
+  // object does not create and destroy a run each time).
+  if (run->numFree == run->numObjects &&
+      (NEXT_RUN(run) != NULL || PREV_RUN(run) != NULL)) {
+    removeSlabRun(run, slabClass);
+    markSlabRun(run, 0);
+    freeBlock((BlockInfo*)UNSCALED_POINTER_SUB(run, TAG_SIZE));
+  }
+}
+
+/* Number of usable bytes in the used heap block or slab object ptr.
+   Safe without the lock: neither the size in a used block's header
+   nor a run's object size changes while the block is in use. */
+static size_t usableSize(void* ptr) {
+  if (inSlabRun(ptr)) {
+    return ((SlabRun*)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1)))->objectSize;
+  }
+  return SIZE(ATOMIC_LOAD(((BlockInfo*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE))->sizeAndTags)) - TAG_SIZE;
+}
+
+
+/******** MAPPED BLOCKS ***********************************************/
+
+
+/* mm_malloc and mm_free without the thread cache or the lock, defined
+   with the top-level interface below. */
+static void* heapMalloc(size_t size);
+static void heapFree(void* ptr);
+
+/* Is ptr, the payload of a block from the current arena or of a
+   mapped block, the latter? */
+static int isMapped(void* ptr) {
+  return (char*)ptr < heapBase || (char*)ptr >= ATOMIC_LOAD(curArena->end);
+}
+
+/* Size of the region for a mapped block with a payload of size bytes:
+   the header and payload rounded up to whole pages, or 0 if that
+   would overflow. */
+static size_t mappedSize(size_t size) {
+  size_t pagesize = mem_syspagesize();
+
+  if (size > (size_t)-1 - MAPPED_HEADER_SIZE - pagesize) {
+    return 0;
+  }
+  return (size + MAPPED_HEADER_SIZE + pagesize - 1) / pagesize * pagesize;
+}
+
+/* Allocate a mapped block with a payload of at least size bytes, or
+   return NULL if memlib has no room for it. */
+static void* mapAlloc(size_t size) {
+  size_t mapSize = mappedSize(size);
+  MappedHeader* header;
+
+  if (mapSize == 0) {
+    return NULL;
+  }
+  header = (MappedHeader*)mem_map(mapSize);
+  if ((ssize_t)header == -1) {
+    return NULL;
+  }
+  header->mapSize = mapSize;
+  STAT_MAPPED(mapSize - MAPPED_HEADER_SIZE);
+  STAT_INC(allocations[NUM_SIZE_CLASSES]);
+  return UNSCALED_POINTER_ADD(header, MAPPED_HEADER_SIZE);
+}
+
+/* Free a block allocated by mapAlloc.  Needs no arena or lock, since
+   memlib does its own locking. */
+static void mapFree(void* ptr) {
+  MappedHeader* header = (MappedHeader*)UNSCALED_POINTER_SUB(ptr, MAPPED_HEADER_SIZE);
+
+  STAT_UNMAPPED(header->mapSize - MAPPED_HEADER_SIZE);
+  mem_unmap(header, header->mapSize);
+}
+
+/* mm_realloc for a mapped block.  A block that stays at or above
+   MMAP_THRESHOLD is resized with mem_remap, which can move its pages
+   without copying them; one that drops below it moves into the heap. */
+static void* mapRealloc(void* ptr, size_t size) {
+  MappedHeader* header = (MappedHeader*)UNSCALED_POINTER_SUB(ptr, MAPPED_HEADER_SIZE);
+  size_t mapSize;
+  void* newPtr;
+
+  if (size < MMAP_THRESHOLD) {
+    if ((newPtr = heapMalloc(size)) == NULL) {
+      return NULL;
+    }
+    memcpy(newPtr, ptr, size);
+    mapFree(ptr);
+    PROLOGUE->reallocCopied++;
+    return newPtr;
+  }
+
+  mapSize = mappedSize(size);
+  if (mapSize == 0) {
+    return NULL;
+  }
+  if (mapSize != header->mapSize) {
+    header = (MappedHeader*)mem_remap(header, header->mapSize, mapSize);
+    if ((ssize_t)header == -1) {
+      return NULL;
+    }
+    STAT_UNMAPPED(header->mapSize - MAPPED_HEADER_SIZE);
+    STAT_MAPPED(mapSize - MAPPED_HEADER_SIZE);
+    header->mapSize = mapSize;
+  }
+  newPtr = UNSCALED_POINTER_ADD(header, MAPPED_HEADER_SIZE);
+
+  // Count by whether the payload moved, even though moving pages is
+  // not a copy.
+  if (newPtr == ptr) {
+    PROLOGUE->reallocInPlace++;
+  } else {
+    PROLOGUE->reallocCopied++;
+  }
+  return newPtr;
+}
+
+
+/* Print the heap by iterating through it as an implicit free list. */
+static void examine_heap() {
+  BlockInfo *block;
+  int listIndex;
+
+  /* print to stderr so output isn't buffered and not output if we crash */
+  fprintf(stderr, "NON_EMPTY_CLASSES: %#llx\n",
+          (unsigned long long)NON_EMPTY_CLASSES);
+  fprintf(stderr, "LARGE_TREE_ROOT: %p\n", (void *)LARGE_TREE_ROOT);
+  for (listIndex = 0; listIndex < NUM_SIZE_CLASSES; listIndex++) {
+    fprintf(stderr, "FREE_LIST_HEAD(%d): %p\n", listIndex,
+            (void *)FREE_LIST_HEAD(listIndex));
+  }
+
+  for (block = (BlockInfo *)UNSCALED_POINTER_ADD(heapBase, FIRST_BLOCK_OFFSET); /* first block on heap */
+       SIZE(block->sizeAndTags) != 0 && (void*)block < (void*)curArena->end;
+       block = (BlockInfo *)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags))) {
+
+    /* print out common block attributes */
+    fprintf(stderr, "%p: %ld %ld %ld\t",
+            (void *)block,
+            (long)SIZE(block->sizeAndTags),
+            (long)(block->sizeAndTags & TAG_PRECEDING_USED),
+            (long)(block->sizeAndTags & TAG_USED));
+
+    /* and allocated/free specific data */
+    if ((block->sizeAndTags & TAG_USED) &&
+        inSlabRun(UNSCALED_POINTER_ADD(block, TAG_SIZE))) {
+      SlabRun* run = (SlabRun*)UNSCALED_POINTER_ADD(block, TAG_SIZE);
+      fprintf(stderr, "SLAB RUN\tobject size: %lu, free: %lu/%lu\n",
+              (unsigned long)run->objectSize,
+              (unsigned long)run->numFree,
+              (unsigned long)run->numObjects);
+    } else if (block->sizeAndTags & TAG_USED) {
+      fprintf(stderr, "ALLOCATED\n");
+    } else if (SIZE(block->sizeAndTags) >= LARGE_BLOCK_SIZE) {
+      fprintf(stderr, "FREE\tleft: %p, right: %p\n",
+              (void *)LEFT((TreeBlock *)block),
+              (void *)RIGHT((TreeBlock *)block));
+    } else {
+      fprintf(stderr, "FREE\tnext: %p, prev: %p\n",
+              (void *)NEXT_FREE(block),
+              (void *)PREV_FREE(block));
+    }
+  }
+  fprintf(stderr, "END OF HEAP\n\n");
+}
+
+
+/******** HEAP CHECKER ************************************************/
+
+
+/* Report that 'block' is inconsistent and return 0. */
+static int checkFailed(void* block, const char* problem) {
+  printf("ERROR: mm_check: block %p %s\n", block, problem);
+  return 0;
+}
+
+/* Does 'block' start inside the current arena's heap, past the
+   prologue and before the heap-footer? */
+static int inHeapBounds(void* block) {
+  return (char*)block >= heapBase + FIRST_BLOCK_OFFSET &&
+    (char*)block < curArena->end - TAG_SIZE;
+}
+
+/* Is the large free block 'block' in the large tree?  Searches down
+   from the root without splaying, so the tree is left as it is. */
+static int inLargeTree(TreeBlock* block) {
+  size_t size = SIZE(block->info.sizeAndTags);
+  TreeBlock* node = LARGE_TREE_ROOT;
+  int cmp;
+
+  while (node != NULL && (cmp = compareTreeKey(size, block, node)) != 0) {
+    node = (cmp < 0) ? LEFT(node) : RIGHT(node);
+  }
+  return node != NULL;
+}
+
+/* Check the slab run 'run', whose block is 'block': the block is one
+   RUN_SIZE page (and at most an unsplittable tail past it), the run's object size and count are consistent, and
+   its free count matches its free map.  Returns 1 if all of that
+   holds, and 0 after reporting what does not. */
+static int checkSlabRun(SlabRun* run, BlockInfo* block) {
+  size_t mapped = 0;
+  int word;
+
+  // placeBlock leaves a tail too small to split off in the block.
+  if (SIZE(block->sizeAndTags) < RUN_SIZE ||
+      SIZE(block->sizeAndTags) >= RUN_SIZE + MIN_BLOCK_SIZE ||
+      (uintptr_t)run % RUN_SIZE != 0) {
+    return checkFailed(block, "is a slab run but not one aligned page");
+  }
+  if (run->objectSize == 0 || run->objectSize > SLAB_MAX_SIZE ||
+      run->objectSize % ALIGNMENT != 0 ||
+      run->numObjects != (RUN_SIZE - TAG_SIZE - sizeof(SlabRun)) / run->objectSize) {
+    return checkFailed(block, "is a slab run with a bad object size or count");
+  }
+  for (word = 0; word < FREE_MAP_WORDS; word++) {
+    mapped += __builtin_popcountll(run->freeMap[word]);
+  }
+  if (mapped != run->numFree) {
+    return checkFailed(block, "is a slab run whose free count disagrees with its free map");
+  }
+  if (run->numObjects < 64 * FREE_MAP_WORDS &&
+      (run->freeMap[run->numObjects / 64] >> (run->numObjects % 64)) != 0) {
+    return checkFailed(block, "is a slab run with free bits past its last object");
+  }
+  return 1;
+}
+
+/* Check 'block' against its neighbors in memory and, if it is free,
+   in its free list or the large tree:
+   o it lies in the heap, with an aligned payload and a sane size;
+   o its TAG_USED bit agrees with the following block's
+     TAG_PRECEDING_USED bit;
+   o if the preceding block is free, that block's boundary tag leads
+     back to a free block ending right here;
+   o if it is free, its header and boundary tag agree, neither
+     neighbor is free, and it is linked into its list with symmetric
+     next/prev links (or found in the tree);
+   o if it is a slab run, the run passes checkSlabRun.
+   Returns 1 if all of that holds, and 0 after reporting what does not. */
+static int checkBlock(BlockInfo* block) {
+  size_t size;
+  size_t precedingSize;
+  BlockInfo* following;
+  BlockInfo* preceding;
+  BlockInfo* nextFree;
+  BlockInfo* prevFree;
+
+  if (!inHeapBounds(block)) {
+    return checkFailed(block, "lies outside the heap");
+  }
+  if ((uintptr_t)UNSCALED_POINTER_ADD(block, TAG_SIZE) % ALIGNMENT != 0) {
+    return checkFailed(block, "has a misaligned payload");
+  }
+  size = SIZE(block->sizeAndTags);
+  if (size < MIN_BLOCK_SIZE ||
+      (char*)block + size > curArena->end - TAG_SIZE) {
+    return checkFailed(block, "has a bad size");
+  }
+
+  following = (BlockInfo*)UNSCALED_POINTER_ADD(block, size);
+  if (((following->sizeAndTags & TAG_PRECEDING_USED) == 0) !=
+      ((block->sizeAndTags & TAG_USED) == 0)) {
+    return checkFailed(block, "disagrees with the TAG_PRECEDING_USED bit of the following block");
+  }
+  if ((block->sizeAndTags & TAG_PRECEDING_USED) == 0) {
+    precedingSize = SIZE(*(tag_t*)UNSCALED_POINTER_SUB(block, TAG_SIZE));
+    preceding = (BlockInfo*)UNSCALED_POINTER_SUB(block, precedingSize);
+    if (precedingSize < MIN_BLOCK_SIZE || !inHeapBounds(preceding) ||
+        SIZE(preceding->sizeAndTags) != precedingSize ||
+        (preceding->sizeAndTags & TAG_USED)) {
+      return checkFailed(block, "follows a free block with a bad boundary tag");
+    }
+  }
+  if (block->sizeAndTags & TAG_USED) {
+    if (inSlabRun(UNSCALED_POINTER_ADD(block, TAG_SIZE))) {
+      return checkSlabRun((SlabRun*)UNSCALED_POINTER_ADD(block, TAG_SIZE), block);
+    }
+    return 1;
+  }
+  if (inSlabRun(UNSCALED_POINTER_ADD(block, TAG_SIZE))) {
+    return checkFailed(block, "is free but marked as a slab run");
+  }
+
+  if (*(tag_t*)UNSCALED_POINTER_ADD(block, size - TAG_SIZE) != block->sizeAndTags) {
+    return checkFailed(block, "has a header and boundary tag that disagree");
+  }
+  if ((block->sizeAndTags & TAG_PRECEDING_USED) == 0 ||
+      (following->sizeAndTags & TAG_USED) == 0) {
+    return checkFailed(block, "is next to another free block");
+  }
+  if (size >= LARGE_BLOCK_SIZE) {
+    return inLargeTree((TreeBlock*)block) ? 1 : checkFailed(block, "is missing from the large tree");
+  }
+  nextFree = NEXT_FREE(block);
+  prevFree = PREV_FREE(block);
+  if (nextFree != NULL && (!inHeapBounds(nextFree) || PREV_FREE(nextFree) != block)) {
+    return checkFailed(block, "has a next block whose prev link does not point back");
+  }
+  if (prevFree == NULL ? FREE_LIST_HEAD(sizeClass(size)) != block
+      : (!inHeapBounds(prevFree) || NEXT_FREE(prevFree) != block)) {
+    return checkFailed(block, "is missing from its free list");
+  }
+  return 1;
+}
+
+/* Walk the large tree in order, without recursion (Morris traversal:
+   each node's in-order predecessor temporarily links back to it, and
+   the link is undone on the way out).  Checks that every node is a
+   large free block and that the keys increase.  Returns the number of
+   nodes, or -1 if the tree is inconsistent. */
+static ssize_t checkLargeTree() {
+  TreeBlock* node = LARGE_TREE_ROOT;
+  TreeBlock* predecessor;
+  TreeBlock* visited;
+  TreeBlock* lastVisited = NULL;
+  ssize_t count = 0;
+  int ok = 1;
+
+  while (node != NULL) {
+    visited = NULL;
+    if (LEFT(node) == NULL) {
+      visited = node;
+      node = RIGHT(node);
+    } else {
+      predecessor = LEFT(node);
+      while (RIGHT(predecessor) != NULL && RIGHT(predecessor) != node) {
+        predecessor = RIGHT(predecessor);
+      }
+      if (RIGHT(predecessor) == NULL) {
+        predecessor->right = TO_LINK(node);
+        node = LEFT(node);
+      } else {
+        predecessor->right = TO_LINK(NULL);
+        visited = node;
+        node = RIGHT(node);
+      }
+    }
+
+    // Keep walking after a failure, so every link gets undone.
+    if (visited != NULL) {
+      count++;
+      if ((visited->info.sizeAndTags & TAG_USED) ||
+          SIZE(visited->info.sizeAndTags) < LARGE_BLOCK_SIZE) {
+        ok = checkFailed(visited, "is in the large tree but is not a large free block");
+      } else if (lastVisited != NULL &&
+                 compareTreeKey(SIZE(visited->info.sizeAndTags), visited, lastVisited) <= 0) {
+        ok = checkFailed(visited, "is out of order in the large tree");
+      }
+      lastVisited = visited;
+    }
+  }
+  return ok ? count : -1;
+}
+
+/* Check the whole current arena: every block on the heap (see
+   checkBlock), that the walk ends exactly at the heap-footer, that the
+   free lists and the large tree hold exactly the free blocks, that the
+   occupancy bitmaps match the lists, that the quick lists hold used
+   blocks of the right sizes, that the run map marks exactly the slab
+   runs, and that each class's run list holds exactly its runs with
+   free objects.  Returns 1 if the arena is
+   consistent, and 0 after reporting the first problem found. */
+static int checkHeap() {
+  BlockInfo* block;
+  char* heapFooter = curArena->end - TAG_SIZE;
+  size_t smallFree = 0;
+  size_t largeFree = 0;
+  size_t listed = 0;
+  size_t quickBlocks = 0;
+  size_t freeBytes = 0;
+  size_t runs = 0;
+  size_t runsWithFree = 0;
+  size_t listedRuns = 0;
+  size_t mapped = 0;
+  size_t word;
+  int listIndex;
+  BlockInfo* prevFree;
+  SlabRun* run;
+  SlabRun* prevRun;
+
+  for (block = (BlockInfo*)UNSCALED_POINTER_ADD(heapBase, FIRST_BLOCK_OFFSET);
+       (char*)block < heapFooter;
+       block = (BlockInfo*)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags))) {
+    // A bad block's size cannot be trusted to find the next one.
+    if (!checkBlock(block)) {
+      return 0;
+    }
+    if ((block->sizeAndTags & TAG_USED) == 0) {
+      freeBytes += SIZE(block->sizeAndTags);
+      if (SIZE(block->sizeAndTags) >= LARGE_BLOCK_SIZE) {
+        largeFree++;
+      } else {
+        smallFree++;
+      }
+    } else if (inSlabRun(UNSCALED_POINTER_ADD(block, TAG_SIZE))) {
+      runs++;
+      if (((SlabRun*)UNSCALED_POINTER_ADD(block, TAG_SIZE))->numFree > 0) {
+        runsWithFree++;
+      }
+    }
+  }
+  if ((char*)block != heapFooter || (*(tag_t*)heapFooter & TAG_USED) == 0) {
+    return checkFailed(block, "runs past the heap-footer");
+  }
+
+  for (listIndex = 0; listIndex < NUM_SIZE_CLASSES; listIndex++) {
+    if ((FREE_LIST_HEAD(listIndex) != NULL) != ((NON_EMPTY_CLASSES >> listIndex) & 1)) {
+      return checkFailed(FREE_LIST_HEAD(listIndex), "heads a list whose occupancy bit is wrong");
+    }
+    prevFree = NULL;
+    for (block = FREE_LIST_HEAD(listIndex); block != NULL; block = NEXT_FREE(block)) {
+      if (!inHeapBounds(block) || (block->sizeAndTags & TAG_USED) ||
+          sizeClass(SIZE(block->sizeAndTags)) != listIndex ||
+          SIZE(block->sizeAndTags) >= LARGE_BLOCK_SIZE) {
+        return checkFailed(block, "is on a free list it does not belong on");
+      }
+      if (PREV_FREE(block) != prevFree) {
+        return checkFailed(block, "has a prev link that does not match its list");
+      }
+      // More blocks than are free means a block is listed twice.
+      if (++listed > smallFree) {
+        return checkFailed(block, "is on the free lists more than once");
+      }
+      prevFree = block;
+    }
+  }
+  if (listed != smallFree) {
+    return checkFailed(NULL, "free lists miss some free blocks");
+  }
+  if (checkLargeTree() != (ssize_t)largeFree) {
+    return checkFailed(LARGE_TREE_ROOT, "roots a tree that does not hold exactly the large free blocks");
+  }
+
+  // Every run seen above has its bit set, so any more bits mark pages
+  // that are not runs.
+  for (word = 0; word < PROLOGUE->runMapWords; word++) {
+    mapped += __builtin_popcountll(PROLOGUE->runMap[word]);
+  }
+  if (mapped != runs) {
+    return checkFailed(PROLOGUE->runMap, "is a run map that marks pages that are not slab runs");
+  }
+  for (listIndex = 0; listIndex < NUM_SLAB_CLASSES; listIndex++) {
+    prevRun = NULL;
+    for (run = SLAB_RUN_HEAD(listIndex); run != NULL; run = NEXT_RUN(run)) {
+      if (!inHeapBounds(run) || !inSlabRun(run) ||
+          SLAB_CLASS(run->objectSize) != listIndex || run->numFree == 0) {
+        return checkFailed(run, "is on a slab run list it does not belong on");
+      }
+      if (PREV_RUN(run) != prevRun) {
+        return checkFailed(run, "has a prev link that does not match its run list");
+      }
+      if (++listedRuns > runsWithFree) {
+        return checkFailed(run, "is on the slab run lists more than once");
+      }
+      prevRun = run;
+    }
+  }
+  if (listedRuns != runsWithFree) {
+    return checkFailed(NULL, "slab run lists miss some runs with free objects");
+  }
+
+  if (PROLOGUE->rover != NULL &&
+      (!inHeapBounds(PROLOGUE->rover) || (PROLOGUE->rover->sizeAndTags & TAG_USED))) {
+    return checkFailed(PROLOGUE->rover, "is the next fit rover but is not free");
+  }
+
+  if (PROLOGUE->quickLists != NULL) {
+    for (listIndex = 0; listIndex < NUM_QUICK_BINS; listIndex++) {
+      block = (BlockInfo*)FROM_LINK(PROLOGUE->quickLists[listIndex]);
+      if ((block != NULL) != ((PROLOGUE->nonEmptyQuickLists >> listIndex) & 1)) {
+        return checkFailed(block, "heads a quick list whose occupancy bit is wrong");
+      }
+      for (; block != NULL; block = NEXT_FREE(block)) {
+        if (!inHeapBounds(block) || (block->sizeAndTags & TAG_USED) == 0 ||
+            QUICK_BIN(SIZE(block->sizeAndTags)) != listIndex) {
+          return checkFailed(block, "is on a quick list it does not belong on");
+        }
+        if (++quickBlocks > PROLOGUE->quickCount) {
+          return checkFailed(block, "is on the quick lists past their count");
+        }
+      }
+    }
+  }
+  if (quickBlocks != PROLOGUE->quickCount) {
+    return checkFailed(NULL, "quick lists hold fewer blocks than their count");
+  }
+
+#if PRECARVE
+  for (listIndex = 0; listIndex < NUM_HOT_SIZES; listIndex++) {
+    for (block = (BlockInfo*)FROM_LINK(PROLOGUE->hotSizes[listIndex].pool);
+         block != NULL; block = NEXT_FREE(block)) {
+      if (!inHeapBounds(block) || (block->sizeAndTags & TAG_USED) == 0 ||
+          SIZE(block->sizeAndTags) != PROLOGUE->hotSizes[listIndex].size) {
+        return checkFailed(block, "is in a pre-carved pool it does not belong in");
+      }
+    }
+  }
+#endif
+#if MM_STATS
+  if (HEAP_STATS->freeBytes != freeBytes) {
+    return checkFailed(NULL, "free blocks do not add up to the free bytes statistic");
+  }
+#else
+  (void)freeBytes;
+#endif
+  return 1;
+}
+
+#if MM_CHECK
+/* Check the blocks touched since the last check (see MM_CHECK), or
+   the whole arena, and stop the program if the heap is inconsistent. */
+static void checkTouched() {
+  int ok = 1;
+  int i;
+
+  if (MM_CHECK > 1 || numTouched > MAX_TOUCHED) {
+    ok = checkHeap();
+  } else {
+    for (i = 0; i < numTouched && ok; i++) {
+      ok = checkBlock(touchedBlocks[i]);
+    }
+  }
+  numTouched = 0;
+  if (!ok) {
+    printf("ERROR: heap check failed\n");
+    exit(1);
+  }
+}
+#endif
+
+/* Set up 'arena' as an empty heap and make it the current arena. */
+static void initArena(Arena* arena) {
+  // Head of the free list.
+  BlockInfo *firstFreeBlock;
+  int listIndex;
+
+  // Initial heap size: heap-header (the HeapPrologue, which stores the
+  // head of each free list, padded to FIRST_BLOCK_OFFSET),
+  // MIN_BLOCK_SIZE bytes of space, TAG_SIZE byte heap-footer.
+  size_t initSize = FIRST_BLOCK_OFFSET+MIN_BLOCK_SIZE+TAG_SIZE;
+  size_t totalSize;
+
+  void* mem_sbrk_result;
+
+  curArena = arena;
+  mem_sbrk_result = mem_arena_sbrk(ARENA_INDEX, initSize);
+  //  printf("mem_sbrk returned %p\n", mem_sbrk_result);
+  if ((ssize_t)mem_sbrk_result == -1) {
+    printf("ERROR: mem_sbrk failed in initArena, returning %p\n", 
+           mem_sbrk_result);
+    exit(1);
+  }
+
+  heapBase = (char*)mem_sbrk_result;
+  ATOMIC_STORE(arena->end, heapBase + initSize);
+  firstFreeBlock = (BlockInfo*)UNSCALED_POINTER_ADD(heapBase, FIRST_BLOCK_OFFSET);
+  arena->zeroStart = mem_arena_zeroed(ARENA_INDEX) ? (char*)firstFreeBlock : arena->end;
+
+  // Total usable size is full size minus heap-header and heap-footer words
+  // NOTE: These are different than the "header" and "footer" of a block!
+  // The heap-header holds pointers to the first free block in each list.
+  // The heap-footer is used to keep the data structures consistent (see
+  // requestMoreSpace() for more info, but you should be able to ignore it).
+  totalSize = initSize - FIRST_BLOCK_OFFSET - TAG_SIZE;
+
+  // The heap starts with one free block, which we initialize now.
+  firstFreeBlock->sizeAndTags = totalSize | TAG_PRECEDING_USED;
+  firstFreeBlock->next = TO_LINK(NULL);
+  firstFreeBlock->prev = TO_LINK(NULL);
+  // boundary tag
+  *((tag_t*)UNSCALED_POINTER_ADD(firstFreeBlock, totalSize - TAG_SIZE)) = totalSize | TAG_PRECEDING_USED;
+  
+  // Tag "useless" word at end of heap as used.
+  // This is the is the heap-footer.
+  *((tag_t*)UNSCALED_POINTER_SUB(arena->end, TAG_SIZE)) = TAG_USED;
+
+  // Empty every free list, then put this new free block on its list.
+  for (listIndex = 0; listIndex < NUM_SIZE_CLASSES; listIndex++) {
+    FREE_LIST_HEAD(listIndex) = NULL;
+  }
+  NON_EMPTY_CLASSES = 0;
+  LARGE_TREE_ROOT = NULL;
+  PROLOGUE->rover = NULL;
+  for (listIndex = 0; listIndex < NUM_SLAB_CLASSES; listIndex++) {
+    SLAB_RUN_HEAD(listIndex) = NULL;
+  }
+  PROLOGUE->runMap = NULL;
+  PROLOGUE->runMapWords = 0;
+  PROLOGUE->reallocInPlace = 0;
+  PROLOGUE->reallocCopied = 0;
+  PROLOGUE->quickLists = NULL;
+  PROLOGUE->nonEmptyQuickLists = 0;
+  PROLOGUE->quickCount = 0;
+#if PRECARVE
+  memset(PROLOGUE->hotSizes, 0, sizeof(PROLOGUE->hotSizes));
+  PROLOGUE->precarveRequests = 0;
+  PROLOGUE->precarveHits = 0;
+#endif
+#if MM_STATS
+  memset(HEAP_STATS, 0, sizeof(mm_stats_t));
+  HEAP_STATS->sbrkCalls = 1;
+#endif
+  insertFreeBlock(firstFreeBlock);
+
+  // Publish the arena only now, so arenaOf never sees it half made.
+  ATOMIC_STORE(arena->base, heapBase);
+}
+
+
+/******** ARENAS ******************************************************/
+
+
+/* The arena whose heap holds ptr, or NULL if there is none (so ptr
+   belongs to a mapped block). */
+static Arena* arenaOf(void* ptr) {
+  int i;
+  char* base;
+
+  for (i = 0; i < MM_ARENAS; i++) {
+    base = ATOMIC_LOAD(arenas[i].base);
+    if (base != NULL && (char*)ptr >= base &&
+        (char*)ptr < ATOMIC_LOAD(arenas[i].end)) {
+      return &arenas[i];
+    }
+  }
+  return NULL;
+}
+
+/* The arena this thread should allocate from. */
+static Arena* threadArena() {
+#if MM_ARENAS == 1
+  return &arenas[0];
+#elif ARENA_BY_CPU
+  int cpu = sched_getcpu();
+  return &arenas[(cpu < 0 ? 0 : cpu) % MM_ARENAS];
+#else
+  static THREAD_LOCAL Arena* arena;
+  static unsigned nextArena;
+
+  if (arena == NULL) {
+    arena = &arenas[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % MM_ARENAS];
+  }
+  return arena;
+#endif
+}
+
+#if MM_THREAD_SAFE
+#if MM_ARENAS > 1
+/* Push the used block ptr of 'arena' onto its remoteFrees list. */
+static void pushRemoteFree(Arena* arena, void* ptr) {
+  void* head = ATOMIC_LOAD(arena->remoteFrees);
+
+  do {
+    *(void**)ptr = head;
+  } while (!__atomic_compare_exchange_n(&arena->remoteFrees, &head, ptr, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+#endif
+
+/* Free every block on the current arena's remoteFrees list. */
+static void drainRemoteFrees() {
+  void* ptr;
+  void* next;
+
+  if (ATOMIC_LOAD(curArena->remoteFrees) == NULL) {
+    return;
+  }
+  ptr = __atomic_exchange_n(&curArena->remoteFrees, NULL, __ATOMIC_ACQUIRE);
+  while (ptr != NULL) {
+    next = *(void**)ptr;
+    heapFree(ptr);
+    ptr = next;
+  }
+}
+#endif
+
+/* Make 'arena', which has been set up, the current arena without
+   locking it.  On its own that is enough only to read what does not
+   change while a block is in use, as usableSize does. */
+static void useArena(Arena* arena) {
+  curArena = arena;
+  heapBase = arena->base;
+}
+
+/* Lock 'arena' and make it the current arena, setting it up first if
+   no thread has used it since mm_init, and free the blocks other
+   threads left on its remoteFrees list. */
+static void enterArena(Arena* arena) {
+#if MM_THREAD_SAFE
+  pthread_mutex_lock(&arena->lock);
+#endif
+  if (arena->base == NULL) {
+    initArena(arena);
+  }
+  useArena(arena);
+#if MM_THREAD_SAFE
+  drainRemoteFrees();
+#endif
+}
+
+/* Unlock 'arena', which the thread entered with enterArena, once the
+   blocks touched in it check out (with MM_CHECK). */
+static void leaveArena(Arena* arena) {
+#if MM_CHECK
+  checkTouched();
+#endif
+#if MM_THREAD_SAFE
+  pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+/* Free ptr into the arena it came from, or leave it on the arena's
+   remoteFrees list if that is not this thread's arena. */
+static void arenaFree(void* ptr) {
+  Arena* arena = arenaOf(ptr);
+
+  if (arena == NULL) {
+    mapFree(ptr);
+    return;
+  }
+#if MM_ARENAS > 1
+  if (arena != threadArena()) {
+    pushRemoteFree(arena, ptr);
+    return;
+  }
+#endif
+  enterArena(arena);
+  heapFree(ptr);
+  leaveArena(arena);
+}
+
+
+/******** THREAD CACHES ***********************************************/
+
+
+#if MM_THREAD_SAFE
+
+/* Each thread has a tcache: for each bin, a LIFO list of up to
+   TCACHE_COUNT blocks that the thread freed and that have not gone
+   back to the heap yet.  Cached blocks stay marked used in the heap,
+   and each list is linked through the first word of the payloads.
+   Bin i holds blocks with at least (i+1)*ALIGNMENT and less than
+   (i+2)*ALIGNMENT usable bytes, so any block in it can serve a request
+   for (i+1)*ALIGNMENT bytes.  Blocks with more than about
+   TCACHE_MAX_SIZE usable bytes are not cached.
+
+   Blocks go back to the arena they came from, whichever thread frees
+   them.  mm_init bumps heapGeneration.  A tcache filled in an earlier
+   generation holds blocks of a heap that no longer exists, so it is
+   emptied without freeing them.  When a thread exits, flushTCache
+   gives its cached blocks back to the heap. */
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT)
+#define TCACHE_COUNT 7
+
+struct TCache {
+  // Head of each bin's list, and number of blocks on it.
+  void* heads[TCACHE_BINS];
+  unsigned char counts[TCACHE_BINS];
+  // heapGeneration the cached blocks belong to.
+  unsigned long generation;
+};
+typedef struct TCache TCache;
+
+static __thread TCache tcache;
+static unsigned long heapGeneration;
+
+// Key whose destructor runs flushTCache when a thread exits.
+static pthread_key_t tcacheKey;
+static pthread_once_t threadsOnce = PTHREAD_ONCE_INIT;
+
+/* Give every block in the tcache 'cache' back to the heap. */
+static void flushTCache(void* cache) {
+  TCache* flushed = (TCache*)cache;
+  int bin;
+  void* ptr;
+
+  if (flushed->generation == ATOMIC_LOAD(heapGeneration)) {
+    for (bin = 0; bin < TCACHE_BINS; bin++) {
+      while ((ptr = flushed->heads[bin]) != NULL) {
+        flushed->heads[bin] = *(void**)ptr;
+        arenaFree(ptr);
+      }
+    }
+  }
+  memset(flushed, 0, sizeof(TCache));
+}
+
+/* One-time setup of the tcache key and the arena locks. */
+static void initThreads() {
+  int i;
+
+  pthread_key_create(&tcacheKey, flushTCache);
+  for (i = 0; i < MM_ARENAS; i++) {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  }
+}
+
+/* Empty this thread's tcache if it belongs to an earlier heap. */
+static void checkTCache() {
+  unsigned long generation = ATOMIC_LOAD(heapGeneration);
+
+  if (tcache.generation != generation) {
+    memset(&tcache, 0, sizeof(TCache));
+    tcache.generation = generation;
+    pthread_setspecific(tcacheKey, &tcache);
+  }
+}
+
+/* Take a block for a request of size bytes from this thread's tcache,
+   or return NULL if it has none. */
+static void* tcacheGet(size_t size) {
+  int bin;
+  void* ptr;
+
+  if (size == 0 || size > TCACHE_MAX_SIZE) {
+    return NULL;
+  }
+  checkTCache();
+  bin = (size + ALIGNMENT - 1) / ALIGNMENT - 1;
+  if ((ptr = tcache.heads[bin]) != NULL) {
+    tcache.heads[bin] = *(void**)ptr;
+    tcache.counts[bin]--;
+  }
+  return ptr;
+}
+
+/* Put the used block ptr in this thread's tcache.  Returns 1 if it
+   was cached, and 0 if it has to be freed to the heap instead. */
+static int tcachePut(void* ptr) {
+  Arena* arena = arenaOf(ptr);
+  size_t bin;
+
+  if (arena == NULL) {
+    return 0;
+  }
+  useArena(arena);
+  bin = usableSize(ptr) / ALIGNMENT - 1;
+  if (bin >= TCACHE_BINS) {
+    return 0;
+  }
+  checkTCache();
+  if (tcache.counts[bin] >= TCACHE_COUNT) {
+    return 0;
+  }
+  *(void**)ptr = tcache.heads[bin];
+  tcache.heads[bin] = ptr;
+  tcache.counts[bin]++;
+  return 1;
+}
+
+#endif
+
+
+
+// TOP-LEVEL ALLOCATOR INTERFACE ------------------------------------
+
+
+/* Initialize the allocator.  Arena 0 is set up now; the others are
+   set up when a thread first uses them. */
+int mm_init () {
+  int i;
+
+#if MM_THREAD_SAFE
+  pthread_once(&threadsOnce, initThreads);
+#endif
+  deferCoalescing = deferRequested;
+  for (i = 0; i < MM_ARENAS; i++) {
+    arenas[i].base = NULL;
+    arenas[i].end = NULL;
+#if MM_THREAD_SAFE
+    arenas[i].remoteFrees = NULL;
+#endif
+  }
+#if MM_STATS
+  mappedLiveBytes = 0;
+#endif
+  initArena(&arenas[0]);
+#if MM_CHECK
+  checkTouched();
+#endif
+#if MM_THREAD_SAFE
+  // Every thread cache now refers to the old heap.
+  ATOMIC_STORE(heapGeneration, heapGeneration + 1);
+#endif
+  return 0;
+}
+
+/* mm_malloc without the thread cache or the lock. */
+static void* heapMalloc(size_t size) {
+  size_t reqSize;
+  BlockInfo * ptrFreeBlock = NULL;
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  // Huge requests get a mapping of their own.
+  if (size >= MMAP_THRESHOLD) {
+    return mapAlloc(size);
+  }
+
+  // Requests too large for a block header to describe get NULL.
+  if (size > MAX_BLOCK_SIZE - TAG_SIZE - ALIGNMENT) {
+    return NULL;
+  }
+
+  // Small requests come from slab runs.
+  if (size <= SLAB_MAX_SIZE) {
+    return slabAlloc(size);
+  }
+
+  reqSize = requestSize(size);
+#if PRECARVE
+  ptrFreeBlock = takePrecarved(reqSize);
+  if (ptrFreeBlock == NULL) {
+    ptrFreeBlock = allocateBlock(reqSize);
+  }
+#else
+  ptrFreeBlock = allocateBlock(reqSize);
+#endif
+  STAT_ALLOCATED(SIZE(ptrFreeBlock->sizeAndTags) - TAG_SIZE);
+  return ((void*) UNSCALED_POINTER_ADD(ptrFreeBlock, TAG_SIZE));  
+
+}
+
+/* mm_malloc_batch without the thread cache or the lock.  Returns how
+   many blocks it stored in out[]. */
+static size_t heapMallocBatch(size_t size, size_t n, void** out) {
+  size_t count;
+
+  if (size == 0) {
+    return 0;
+  }
+  // Slab objects are carved from their runs in bulk already, and a
+  // mapped block is a mapping of its own however it is asked for.
+  if (size <= SLAB_MAX_SIZE || size >= MMAP_THRESHOLD) {
+    for (count = 0; count < n && (out[count] = heapMalloc(size)) != NULL; count++) {
+    }
+    return count;
+  }
+  if (size > MAX_BLOCK_SIZE - TAG_SIZE - ALIGNMENT) {
+    return 0;
+  }
+  allocateBlocks(requestSize(size), n, out);
+#if MM_STATS
+  for (count = 0; count < n; count++) {
+    STAT_ALLOCATED(usableSize(out[count]));
+  }
+#endif
+  return n;
+}
+
+/* mm_memalign without the lock, for an alignment (a power of two)
+   larger than ALIGNMENT.  Every such block comes from the heap, however
+   large: a mapped block's payload sits MAPPED_HEADER_SIZE bytes into
+   its pages, and a slab object's wherever its slot falls. */
+static void* heapMemalign(size_t alignment, size_t size) {
+  BlockInfo* block;
+
+  if (size == 0) {
+    return NULL;
+  }
+  // allocateAlignedBlock may need room for a leading free block too.
+  if (alignment >= MAX_BLOCK_SIZE / 2 ||
+      size > MAX_BLOCK_SIZE - TAG_SIZE - 2 * ALIGNMENT - alignment - MIN_BLOCK_SIZE) {
+    return NULL;
+  }
+  block = allocateAlignedBlock(requestSize(size), alignment);
+  STAT_ALLOCATED(SIZE(block->sizeAndTags) - TAG_SIZE);
+  return UNSCALED_POINTER_ADD(block, TAG_SIZE);
+}
+
+/* mm_calloc without the thread cache or the lock, for a request of
+   size bytes.  A mapped block's pages are fresh from mem_map, so they
+   are zero already.  A heap block carved at or past the arena's
+   zeroStart only needs clearing below the old zeroStart, over the free
+   block links just past it, and over the boundary tag at its end;
+   anything else (a slab object, a block reused from below zeroStart)
+   is cleared in full. */
+static void* heapCalloc(size_t size) {
+  char* zeroStart = curArena->zeroStart;
+  char* payload;
+  char* blockEnd;
+  char* dirtyEnd;
+  BlockInfo* block;
+
+  if (size >= MMAP_THRESHOLD) {
+    return mapAlloc(size);
+  }
+  if ((payload = heapMalloc(size)) == NULL) {
+    return NULL;
+  }
+  if (size <= SLAB_MAX_SIZE) {
+    memset(payload, 0, size);
+    return payload;
+  }
+
+  block = (BlockInfo*)UNSCALED_POINTER_SUB(payload, TAG_SIZE);
+  blockEnd = (char*)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags));
+  if (curArena->zeroStart > blockEnd) {
+    // Reused, pre-carved, or grown into dirty space.
+    memset(payload, 0, size);
+    return payload;
+  }
+  if ((char*)block > zeroStart) {
+    zeroStart = (char*)block;
+  }
+  dirtyEnd = zeroStart + sizeof(TreeBlock);
+  if (dirtyEnd > payload + size) {
+    dirtyEnd = payload + size;
+  }
+  if (dirtyEnd > payload) {
+    memset(payload, 0, dirtyEnd - payload);
+  }
+  if (payload + size > blockEnd - TAG_SIZE) {
+    memset(blockEnd - TAG_SIZE, 0, payload + size - (blockEnd - TAG_SIZE));
+  }
+  return payload;
+}
+
+/* heapFree for ptr known to be a heap block, neither mapped nor a
+   slab object. */
+static void heapFreeBlock(void* ptr) {
+  BlockInfo* block = (BlockInfo*) UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+
+  STAT_FREED(SIZE(block->sizeAndTags) - TAG_SIZE);
+  if (!deferCoalescing || !quickPut(block)) {
+    freeBlock(block);
+  }
+}
+
+/* mm_free without the thread cache or the lock. */
+static void heapFree(void* ptr) {
+  // Freeing NULL is a no-op.
+  if (ptr == NULL) {
+    return;
+  }
+
+  if (isMapped(ptr)) {
+    mapFree(ptr);
+  } else if (inSlabRun(ptr)) {
+    slabFree(ptr);
+  } else {
+    heapFreeBlock(ptr);
+  }
+}
+
+/* mm_free_batch without the lock, for heap blocks and slab objects of
+   the current arena sorted by address.  Blocks that lie next to each
+   other in the heap are first joined into one used block, so each run
+   of them is freed, and coalesced with its neighbors, in one go. */
+static void heapFreeBatch(void** ptrs, size_t n) {
+  BlockInfo* block;
+  BlockInfo* next;
+  char* runEnd;
+  size_t i;
+  size_t j;
+
+  for (i = 0; i < n; i = j) {
+    j = i + 1;
+    if (inSlabRun(ptrs[i])) {
+      slabFree(ptrs[i]);
+      continue;
+    }
+    block = (BlockInfo*)UNSCALED_POINTER_SUB(ptrs[i], TAG_SIZE);
+    STAT_FREED(SIZE(block->sizeAndTags) - TAG_SIZE);
+    runEnd = (char*)UNSCALED_POINTER_ADD(block, SIZE(block->sizeAndTags));
+    for (; j < n && ptrs[j] == UNSCALED_POINTER_ADD(runEnd, TAG_SIZE); j++) {
+      next = (BlockInfo*)runEnd;
+      STAT_FREED(SIZE(next->sizeAndTags) - TAG_SIZE);
+      UNTOUCH_BLOCK(next);
+      STAT_INC(coalesces);
+      runEnd = (char*)UNSCALED_POINTER_ADD(next, SIZE(next->sizeAndTags));
+    }
+    block->sizeAndTags = (size_t)(runEnd - (char*)block) | (block->sizeAndTags & (ALIGNMENT - 1));
+    TOUCH_BLOCK(block);
+    freeBlock(block);
+  }
+}
+
+/* Check every arena's heap for consistency (see checkHeap).  Returns
+   nonzero if and only if the heap is consistent. */
+int mm_check() {
+  int ok = 1;
+  int i;
+
+  for (i = 0; i < MM_ARENAS; i++) {
+    if (ATOMIC_LOAD(arenas[i].base) != NULL) {
+      enterArena(&arenas[i]);
+      ok = checkHeap() && ok;
+      leaveArena(&arenas[i]);
+    }
+  }
+  return ok;
+}
+
+/* Headroom to reserve past reqSize for a block that keeps growing. */
+static size_t reallocHeadroom(size_t reqSize) {
+  size_t headroom = (reqSize >> REALLOC_HEADROOM_SHIFT) & ~(size_t)(ALIGNMENT - 1);
+  return (headroom < REALLOC_HEADROOM_MAX) ? headroom : REALLOC_HEADROOM_MAX;
+}
+
+/* Move the heap payload ptr, holding oldSize bytes, to a new mapped
+   block of size bytes (more than oldSize). */
+static void* moveToMapping(void* ptr, size_t oldSize, size_t size) {
+  void* newPtr = mapAlloc(size);
+
+  if (newPtr == NULL) {
+    return NULL;
+  }
+  memcpy(newPtr, ptr, oldSize);
+  heapFree(ptr);
+  PROLOGUE->reallocCopied++;
+  return newPtr;
+}
+
+/* mm_realloc without the lock: change the size of the block
+   referenced by ptr to size bytes and return a pointer to the resized
+   block.  Blocks shrink in place and
+   grow in place whenever the space after them allows; the contents
+   are copied to a new block only as a last resort.  A block that has
+   been grown before (TAG_REALLOCED) is given headroom past the
+   requested size, so later growth is likely to fit without moving. */
+static void* heapRealloc(void* ptr, size_t size) {
+  BlockInfo* block;
+  BlockInfo* newBlock;
+  SlabRun* run;
+  size_t oldSize;
+  size_t reqSize;
+  size_t headroom = 0;
+  void* newPtr;
+
+  if (ptr == NULL) {
+    return heapMalloc(size);
+  }
+  if (size == 0) {
+    heapFree(ptr);
+    return NULL;
+  }
+  if (isMapped(ptr)) {
+    return mapRealloc(ptr, size);
+  }
+
+  if (inSlabRun(ptr)) {
+    // A slab object can only stay where it is if it is large enough.
+    run = (SlabRun*)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1));
+    oldSize = run->objectSize;
+    if (size <= oldSize) {
+      PROLOGUE->reallocInPlace++;
+      return ptr;
+    }
+  } else {
+    block = (BlockInfo*)UNSCALED_POINTER_SUB(ptr, TAG_SIZE);
+    oldSize = SIZE(block->sizeAndTags) - TAG_SIZE;
+
+    // Too large for a heap block: only a mapping can hold it.
+    if (size > MAX_BLOCK_SIZE - TAG_SIZE - ALIGNMENT - REALLOC_HEADROOM_MAX) {
+      return (size >= MMAP_THRESHOLD) ? moveToMapping(ptr, oldSize, size) : NULL;
+    }
+    reqSize = requestSize(size);
+    if (block->sizeAndTags & TAG_REALLOCED) {
+      headroom = reallocHeadroom(reqSize);
+    }
+
+    if (reqSize <= SIZE(block->sizeAndTags)) {
+      // Shrinking, or growing into headroom reserved earlier.  Only
+      // space beyond the headroom is given back.
+      if (reqSize + headroom < SIZE(block->sizeAndTags)) {
+        shrinkBlock(block, reqSize + headroom);
+        STAT_RESIZED(oldSize, SIZE(block->sizeAndTags) - TAG_SIZE);
+      }
+      PROLOGUE->reallocInPlace++;
+      return ptr;
+    }
+
+    // Try to grow with headroom into a free neighbor, then without.
+    // A block past MMAP_THRESHOLD stays in the heap as long as it can
+    // grow in place; it moves to a mapping only when it has to move.
+    if ((headroom > 0 && growBlockInPlace(block, reqSize + headroom, 0)) ||
+        growBlockInPlace(block, reqSize, 1)) {
+      STAT_RESIZED(oldSize, SIZE(block->sizeAndTags) - TAG_SIZE);
+      block->sizeAndTags |= TAG_REALLOCED;
+      PROLOGUE->reallocInPlace++;
+      return ptr;
+    }
+  }
+
+  // Move the block.  A block that had to grow is tagged, so the next
+  // time it grows it gets headroom.
+  if (size >= MMAP_THRESHOLD) {
+    return moveToMapping(ptr, oldSize, size);
+  } else if (size <= SLAB_MAX_SIZE) {
+    newPtr = slabAlloc(size);
+  } else {
+    reqSize = requestSize(size);
+    newBlock = allocateBlock(reqSize + headroom);
+    if (headroom > 0 && isLastBlock(newBlock)) {
+      shrinkBlock(newBlock, reqSize);
+    }
+    if (size > oldSize) {
+      newBlock->sizeAndTags |= TAG_REALLOCED;
+    }
+    STAT_ALLOCATED(SIZE(newBlock->sizeAndTags) - TAG_SIZE);
+    newPtr = UNSCALED_POINTER_ADD(newBlock, TAG_SIZE);
+  }
+  memcpy(newPtr, ptr, (oldSize < size) ? oldSize : size);
+  heapFree(ptr);
+  PROLOGUE->reallocCopied++;
+  return newPtr;
+}
+
+/* Turn deferred coalescing (see QUICK_MAX_SIZE) on or off for every
+   heap set up by later calls to mm_init.  It is off by default. */
+void mm_defer_coalescing(int defer) {
+  deferRequested = defer;
+}
+
+/* Report how many mm_realloc calls since mm_init kept their block in
+   place and how many had to move it. */
+void mm_realloc_stats(size_t* inPlace, size_t* copied) {
+  int i;
+
+  *inPlace = 0;
+  *copied = 0;
+  for (i = 0; i < MM_ARENAS; i++) {
+    if (ATOMIC_LOAD(arenas[i].base) != NULL) {
+      enterArena(&arenas[i]);
+      *inPlace += PROLOGUE->reallocInPlace;
+      *copied += PROLOGUE->reallocCopied;
+      leaveArena(&arenas[i]);
+    }
+  }
+}
+
+/* Report how many mm_malloc calls since mm_init asked for a heap block,
+   and how many of those got a pre-carved one (both 0 without
+   PRECARVE). */
+void mm_precarve_stats(size_t* hits, size_t* requests) {
+  int i;
+
+  *hits = 0;
+  *requests = 0;
+  for (i = 0; i < MM_ARENAS; i++) {
+    if (ATOMIC_LOAD(arenas[i].base) != NULL) {
+#if PRECARVE
+      enterArena(&arenas[i]);
+      *hits += PROLOGUE->precarveHits;
+      *requests += PROLOGUE->precarveRequests;
+      leaveArena(&arenas[i]);
+#endif
+    }
+  }
+}
+
+/* Fill in *stats with the statistics (see MM_STATS) of every arena's
+   heap, added up, with the mapped blocks' bytes in liveBytes.  Returns 1 if mm.c keeps them, and 0 (and zeroes
+   *stats) if it was built without MM_STATS. */
+int mm_stats(mm_stats_t* stats) {
+  int i;
+#if MM_STATS
+  int sizeClass;
+#endif
+
+  memset(stats, 0, sizeof(*stats));
+  for (i = 0; i < MM_ARENAS; i++) {
+    if (ATOMIC_LOAD(arenas[i].base) != NULL) {
+#if MM_STATS
+      enterArena(&arenas[i]);
+      stats->liveBytes += HEAP_STATS->liveBytes;
+      stats->freeBytes += HEAP_STATS->freeBytes;
+      for (sizeClass = 0; sizeClass < MM_STATS_CLASSES; sizeClass++) {
+        stats->freeBlocks[sizeClass] += HEAP_STATS->freeBlocks[sizeClass];
+        stats->allocations[sizeClass] += HEAP_STATS->allocations[sizeClass];
+      }
+      stats->splits += HEAP_STATS->splits;
+      stats->coalesces += HEAP_STATS->coalesces;
+      stats->searches += HEAP_STATS->searches;
+      stats->searchSteps += HEAP_STATS->searchSteps;
+      stats->sbrkCalls += HEAP_STATS->sbrkCalls;
+      leaveArena(&arenas[i]);
+#endif
+    }
+  }
+#if MM_STATS
+  stats->liveBytes += ATOMIC_LOAD(mappedLiveBytes);
+#endif
+  return MM_STATS;
+}
+
+/* Allocate a block of size size and return a pointer to it. */
+void* mm_malloc (size_t size) {
+  Arena* arena;
+  void* ptr;
+
+#if MM_THREAD_SAFE
+  if ((ptr = tcacheGet(size)) != NULL) {
+    return ptr;
+  }
+#endif
+  arena = threadArena();
+  enterArena(arena);
+  ptr = heapMalloc(size);
+  leaveArena(arena);
+  return ptr;
+}
+
+/* Allocate a block of size bytes whose address is a multiple of
+   alignment, and return a pointer to it, or NULL if alignment is not a
+   power of two.  Any alignment up to ALIGNMENT is what mm_malloc gives
+   anyway.  For a larger one, the misaligned leading part of a free
+   block is split off as a free block of its own and the tail past size
+   is split off as usual (see allocateAlignedBlock), so no padding is
+   left inside the block. */
+void* mm_memalign(size_t alignment, size_t size) {
+  Arena* arena;
+  void* ptr;
+
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    return NULL;
+  }
+  if (alignment <= ALIGNMENT) {
+    return mm_malloc(size);
+  }
+  arena = threadArena();
+  enterArena(arena);
+  ptr = heapMemalign(alignment, size);
+  leaveArena(arena);
+  return ptr;
+}
+
+/* C11 aligned_alloc: mm_memalign under its standard name. */
+void* mm_aligned_alloc(size_t alignment, size_t size) {
+  return mm_memalign(alignment, size);
+}
+
+/* Allocate an array of nmemb elements of size bytes each, with every
+   byte zero, and return a pointer to it, or NULL if the total size
+   overflows.  Fresh heap space and mapped blocks are not cleared again
+   (see heapCalloc). */
+void* mm_calloc(size_t nmemb, size_t size) {
+  Arena* arena;
+  void* ptr;
+
+  if (size != 0 && nmemb > (size_t)-1 / size) {
+    return NULL;
+  }
+  size *= nmemb;
+#if MM_THREAD_SAFE
+  if ((ptr = tcacheGet(size)) != NULL) {
+    memset(ptr, 0, size);
+    return ptr;
+  }
+#endif
+  arena = threadArena();
+  enterArena(arena);
+  ptr = heapCalloc(size);
+  leaveArena(arena);
+  return ptr;
+}
+
+/* Allocate n blocks of size bytes each, store pointers to them in
+   out[], and return how many were allocated (n unless memory ran
+   out).  A burst of heap blocks is carved from as few free blocks as
+   possible (see allocateBlocks) under a single lock. */
+size_t mm_malloc_batch(size_t size, size_t n, void** out) {
+  Arena* arena;
+  size_t count = 0;
+
+#if MM_THREAD_SAFE
+  while (count < n && (out[count] = tcacheGet(size)) != NULL) {
+    count++;
   }
+#endif
+  if (count < n) {
+    arena = threadArena();
+    enterArena(arena);
+    count += heapMallocBatch(size, n - count, out + count);
+    leaveArena(arena);
+  }
+  return count;
+}
 
-  return ((void*) UNSCALED_POINTER_ADD(ptrFreeBlock, WORD_SIZE));  
+/* Order two pointers by address, for qsort. */
+static int compareAddresses(const void* a, const void* b) {
+  uintptr_t x = (uintptr_t)*(void* const*)a;
+  uintptr_t y = (uintptr_t)*(void* const*)b;
 
+  return (x > y) - (x < y);
+}
+
+/* Free the n blocks referenced by ptrs[] (NULL entries are skipped),
+   leaving ptrs[] sorted by address.  Sorted, each arena's blocks are
+   next to each other and can be freed under a single lock, and
+   neighboring blocks are coalesced in one sweep (see heapFreeBatch).
+   Freed blocks skip the thread cache. */
+void mm_free_batch(void** ptrs, size_t n) {
+  Arena* arena;
+  size_t i = 0;
+  size_t j;
+
+  qsort(ptrs, n, sizeof(void*), compareAddresses);
+  while (i < n && ptrs[i] == NULL) {
+    i++;
+  }
+  for (; i < n; i = j) {
+    arena = arenaOf(ptrs[i]);
+    j = i + 1;
+    if (arena == NULL) {
+      mapFree(ptrs[i]);
+      continue;
+    }
+    // Mapped blocks never lie inside an arena's region, so the
+    // arena's blocks are the ones up to its end.
+    while (j < n && (char*)ptrs[j] < ATOMIC_LOAD(arena->end)) {
+      j++;
+    }
+#if MM_ARENAS > 1
+    if (arena != threadArena()) {
+      for (; i < j; i++) {
+        pushRemoteFree(arena, ptrs[i]);
+      }
+      continue;
+    }
+#endif
+    enterArena(arena);
+    heapFreeBatch(ptrs + i, j - i);
+    leaveArena(arena);
+  }
 }
 
 /* Free the block referenced by ptr. */
 void mm_free (void *ptr) {
-  size_t payloadSize;
-  BlockInfo * blockInfo;
-  BlockInfo * followingBlock;
+  // Freeing NULL is a no-op.
+  if (ptr == NULL) {
+    return;
+  }
 
-  // Implement mm_free.  You can change or remove the declaraions
-  // above.  They are included as minor hints.
+#if MM_THREAD_SAFE
+  if (tcachePut(ptr)) {
+    return;
+  }
+#endif
+  arenaFree(ptr);
+}
+
+/* mm_free for a block the caller knows the size of: size is the size
+   it asked mm_malloc (or mm_calloc, mm_realloc, mm_memalign) for, or
+   anything from there up to mm_usable_size.  The size cannot say which
+   slab class or mapping a block is in, since mm_realloc can shrink
+   either in place.  But it does rule both out when it lies strictly
+   between SLAB_MAX_SIZE and MMAP_THRESHOLD: a slab object has at most
+   SLAB_MAX_SIZE usable bytes, and a mapped block that shrinks below
+   MMAP_THRESHOLD moves into the heap.  Such a block is freed as a heap
+   block straight away, without the heap bounds and run map lookups
+   mm_free makes to find out what it is.  Any other size takes the
+   mm_free path.  With MM_CHECK, a size past the block's usable bytes
+   is reported. */
+void mm_free_sized(void* ptr, size_t size) {
+  Arena* arena;
+
+  if (ptr == NULL) {
+    return;
+  }
+#if MM_CHECK
+  if (size > mm_usable_size(ptr)) {
+    printf("ERROR: mm_free_sized given %zu bytes for a block of %zu\n",
+           size, mm_usable_size(ptr));
+    exit(1);
+  }
+#endif
+  if (size <= SLAB_MAX_SIZE || size >= MMAP_THRESHOLD) {
+    mm_free(ptr);
+    return;
+  }
 
+#if MM_THREAD_SAFE
+  if (tcachePut(ptr)) {
+    return;
+  }
+#endif
+  arena = arenaOf(ptr);
+#if MM_CHECK
+  if (arena == NULL) {
+    printf("ERROR: mm_free_sized given %zu bytes for a mapped block\n", size);
+    exit(1);
+  }
+#endif
+#if MM_ARENAS > 1
+  if (arena != threadArena()) {
+    pushRemoteFree(arena, ptr);
+    return;
+  }
+#endif
+  enterArena(arena);
+  heapFreeBlock(ptr);
+  leaveArena(arena);
 }
 
+/* Number of bytes the block referenced by ptr can hold, at least the
+   size it was allocated for, or 0 if ptr is NULL.  The caller may use
+   all of them. */
+size_t mm_usable_size(void* ptr) {
+  Arena* arena;
 
-// Implement a heap consistency checker as needed.
-int mm_check() {
-  return 0;
+  if (ptr == NULL) {
+    return 0;
+  }
+  arena = arenaOf(ptr);
+  if (arena == NULL) {
+    return ((MappedHeader*)UNSCALED_POINTER_SUB(ptr, MAPPED_HEADER_SIZE))->mapSize -
+      MAPPED_HEADER_SIZE;
+  }
+  useArena(arena);
+  return usableSize(ptr);
 }
 
-// Extra credit.
+/* Change the size of the block referenced by ptr to size bytes and
+   return a pointer to the resized block (see heapRealloc). */
 void* mm_realloc(void* ptr, size_t size) {
-  // ... implementation here ...
-  return NULL;
+  Arena* arena = (ptr != NULL) ? arenaOf(ptr) : threadArena();
+  void* newPtr;
+
+  // A mapped block belongs to no arena; any arena can resize it.
+  if (arena == NULL) {
+    arena = threadArena();
+  }
+  enterArena(arena);
+  newPtr = heapRealloc(ptr, size);
+  leaveArena(arena);
+  return newPtr;
+}
+
+
+/******** REGIONS *****************************************************/
+
+
+/* A region hands out memory by bumping a pointer through chunks it
+   gets with mm_malloc, and gives all of it back at once when it is
+   destroyed, so objects that die together cost nothing to free one by
+   one.  Chunks are linked, newest first, through their first word;
+   the region itself sits in the oldest one.  Chunk sizes double from
+   REGION_MIN_CHUNK up to REGION_MAX_CHUNK, which keeps them below
+   MMAP_THRESHOLD and so in the heap, and a region holds few enough of
+   them that destroying it is quick.  A request over a quarter of the
+   next chunk size gets a chunk of its own, so it does not strand the
+   rest of the current one.  A region is not locked: only one thread
+   at a time may use it. */
+#define REGION_MIN_CHUNK 1024
+#define REGION_MAX_CHUNK (64 * 1024)
+#define REGION_LINK_SIZE ALIGNMENT
+// Most chunks mm_region_destroy frees in one mm_free_batch call.
+#define REGION_FREE_BATCH 64
+
+struct mm_region {
+  // Newest chunk.
+  void* chunks;
+  // Next free byte of the newest chunk, and the end of its usable bytes.
+  char* cursor;
+  char* limit;
+  // Size of the next chunk.
+  size_t chunkSize;
+};
+
+/* Create an empty region, or return NULL if there is no memory for
+   it. */
+mm_region_t* mm_region_create() {
+  size_t regionSize = ALIGNMENT * ((sizeof(mm_region_t) + ALIGNMENT - 1) / ALIGNMENT);
+  void* chunk = mm_malloc(REGION_MIN_CHUNK);
+  mm_region_t* region;
+
+  if (chunk == NULL) {
+    return NULL;
+  }
+  *(void**)chunk = NULL;
+  region = (mm_region_t*)UNSCALED_POINTER_ADD(chunk, REGION_LINK_SIZE);
+  region->chunks = chunk;
+  region->cursor = (char*)UNSCALED_POINTER_ADD(region, regionSize);
+  region->limit = (char*)UNSCALED_POINTER_ADD(chunk, mm_usable_size(chunk));
+  region->chunkSize = 2 * REGION_MIN_CHUNK;
+  return region;
+}
+
+/* mm_region_alloc once the newest chunk is too full for size bytes
+   (a multiple of ALIGNMENT). */
+static void* regionAllocChunk(mm_region_t* region, size_t size) {
+  void* chunk;
+  void* ptr;
+
+  if (size > (size_t)-1 - REGION_LINK_SIZE) {
+    return NULL;
+  }
+  // A large request gets a chunk of its own, linked behind the newest
+  // so the newest stays the one to bump through.
+  if (size > region->chunkSize / 4) {
+    if ((chunk = mm_malloc(REGION_LINK_SIZE + size)) == NULL) {
+      return NULL;
+    }
+    *(void**)chunk = *(void**)region->chunks;
+    *(void**)region->chunks = chunk;
+    return UNSCALED_POINTER_ADD(chunk, REGION_LINK_SIZE);
+  }
+
+  if ((chunk = mm_malloc(region->chunkSize)) == NULL) {
+    return NULL;
+  }
+  *(void**)chunk = region->chunks;
+  region->chunks = chunk;
+  ptr = UNSCALED_POINTER_ADD(chunk, REGION_LINK_SIZE);
+  region->cursor = (char*)UNSCALED_POINTER_ADD(ptr, size);
+  // Bump into the slack mm_malloc rounded the chunk up by, too.
+  region->limit = (char*)UNSCALED_POINTER_ADD(chunk, mm_usable_size(chunk));
+  if (region->chunkSize < REGION_MAX_CHUNK) {
+    region->chunkSize *= 2;
+  }
+  return ptr;
+}
+
+/* Allocate size bytes from 'region' and return a pointer to them, or
+   NULL if size is 0 or there is no memory.  They stay allocated until
+   the region is destroyed; there is no way to free them sooner. */
+void* mm_region_alloc(mm_region_t* region, size_t size) {
+  void* ptr;
+
+  if (size == 0 || size > (size_t)-1 - ALIGNMENT) {
+    return NULL;
+  }
+  size = ALIGNMENT * ((size + ALIGNMENT - 1) / ALIGNMENT);
+  if (size > (size_t)(region->limit - region->cursor)) {
+    return regionAllocChunk(region, size);
+  }
+  ptr = region->cursor;
+  region->cursor += size;
+  return ptr;
+}
+
+/* Free 'region' and everything allocated from it (NULL is a no-op).
+   The chunks go to mm_free_batch, up to REGION_FREE_BATCH at a time,
+   so they are freed under one lock per arena and chunks that lie next
+   to each other are coalesced in one sweep. */
+void mm_region_destroy(mm_region_t* region) {
+  void* chunks[REGION_FREE_BATCH];
+  void* chunk;
+  size_t n = 0;
+
+  if (region == NULL) {
+    return;
+  }
+  // Every link is read before its chunk is freed, and the region
+  // itself, in the oldest chunk, is read only here.
+  for (chunk = region->chunks; chunk != NULL; chunk = *(void**)chunk) {
+    if (n == REGION_FREE_BATCH) {
+      mm_free_batch(chunks, n);
+      n = 0;
+    }
+    chunks[n++] = chunk;
+  }
+  mm_free_batch(chunks, n);
 }
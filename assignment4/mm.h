@@ -3,6 +3,50 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern int mm_check (void);
+extern void mm_defer_coalescing(int defer);
+
+// Placement and insertion policies, for building mm.c with
+// -DMM_PLACEMENT=... and -DMM_INSERTION=...
+#define MM_FIRST_FIT 0
+#define MM_NEXT_FIT 1
+#define MM_BEST_FIT 2
+#define MM_GOOD_FIT 3
+#define MM_LIFO 0
+#define MM_ADDRESS_ORDERED 1
 
 // Extra credit
 extern void* mm_realloc(void* ptr, size_t size);
+extern void mm_realloc_stats(size_t* inPlace, size_t* copied);
+extern void mm_precarve_stats(size_t* hits, size_t* requests);
+
+// Allocator statistics for mm_stats (kept only with MM_STATS)
+#define MM_STATS_CLASSES 25
+typedef struct {
+  size_t liveBytes;     // usable bytes of the blocks handed out
+  size_t freeBytes;     // bytes in free heap blocks
+  // Free blocks per size class; the last entry counts the large tree.
+  size_t freeBlocks[MM_STATS_CLASSES];
+  // Blocks handed out per size class; the last entry counts large and
+  // mapped blocks.
+  size_t allocations[MM_STATS_CLASSES];
+  size_t splits;        // blocks split in two
+  size_t coalesces;     // free blocks merged into a neighbor
+  size_t searches;      // free list searches
+  size_t searchSteps;   // free list blocks those searches looked at
+  size_t sbrkCalls;     // times the heap was created or grown
+} mm_stats_t;
+extern int mm_stats(mm_stats_t* stats);
+
+// Regions: bump allocation, freed all at once by mm_region_destroy
+typedef struct mm_region mm_region_t;
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+extern void mm_region_destroy(mm_region_t *region);